@@ -1,6 +1,7 @@
 #include <string>
 #include <iostream>
 #include <memory>
+#include <vector>
 
 #include "AHVDatabaseClient.hpp"
 #include "AHVExtractor.hpp"
@@ -49,9 +50,14 @@ int main(int argc, char** argv) {
   // input.
   auto extractor = NewExtractorFromSpec(argv[1]);
   extractor->Process(ReadAllFromStdin());
-  for (const std::string& ahv : extractor->Results()) {
-    if (ahv_database_client.get() == nullptr || ahv_database_client->Lookup(ahv)) {
-      std::cout << ahv << std::endl;
+  std::vector<std::string> ahvs(extractor->Results().begin(), extractor->Results().end());
+  // Check all the matched AHVs in a single call.
+  std::vector<bool> known = ahv_database_client.get() == nullptr || ahvs.empty()
+      ? std::vector<bool>(ahvs.size(), true)
+      : ahv_database_client->LookupBatch(ahvs);
+  for (size_t i = 0; i < ahvs.size(); ++i) {
+    if (known[i]) {
+      std::cout << ahvs[i] << std::endl;
     }
   }
 
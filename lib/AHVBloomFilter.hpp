@@ -0,0 +1,74 @@
+#ifndef AHV_DEFENDER_AHV_BLOOM_FILTER_H_
+#define AHV_DEFENDER_AHV_BLOOM_FILTER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "AHVMmapArray.hpp"
+
+// Blocked Bloom filter over 32 bit keys: a key maps to one cache line of 8
+// words and sets one bit in each, so a test reads a single cache line. With
+// BITS_PER_KEY bits per key about 0.5% of the absent keys test positive.
+// Bits are only ever set, concurrently with tests; keys cannot be removed.
+class AHVBloomFilter {
+ public:
+  static const int BITS_PER_KEY = 16;
+
+  explicit AHVBloomFilter(size_t capacity)
+      : blocks_(capacity * BITS_PER_KEY / (8 * sizeof(Block)) + 1), data_(blocks_) { }
+
+  void Add(uint32_t key) {
+    uint64_t bits = Bits(key);
+    Block& block = data_[BlockOf(key)];
+    for (int i = 0; i < WORDS; ++i) {
+      block.words[i].fetch_or((uint64_t) 1 << ((bits >> (6 * i)) & 63), std::memory_order_release);
+    }
+  }
+
+  // False if key was never added.
+  bool MayContain(uint32_t key) const {
+    uint64_t bits = Bits(key);
+    const Block& block = data_[BlockOf(key)];
+    for (int i = 0; i < WORDS; ++i) {
+      if (!((block.words[i].load(std::memory_order_acquire) >> ((bits >> (6 * i)) & 63)) & 1)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void Prefetch(uint32_t key) const {
+    __builtin_prefetch(&data_[BlockOf(key)]);
+  }
+
+  size_t bytes() const {
+    return blocks_ * sizeof(Block);
+  }
+
+ private:
+  static const int WORDS = 8;
+
+  // Fresh mappings are zeroed, so are the words.
+  struct alignas(64) Block {
+    std::atomic<uint64_t> words[WORDS];
+  };
+
+  // Multiplicative hashing, keys are already uniformly distributed hash bits
+  // but neighbouring keys should not share blocks.
+  size_t BlockOf(uint32_t key) const {
+    uint64_t h = (uint64_t) key * 0x9e3779b97f4a7c15ULL;
+    return (size_t) (((unsigned __int128) h * blocks_) >> 64);
+  }
+
+  // 6 bits per word.
+  static uint64_t Bits(uint32_t key) {
+    uint64_t h = ((uint64_t) key ^ ((uint64_t) key << 29)) * 0xc2b2ae3d27d4eb4fULL;
+    return h ^ (h >> 31);
+  }
+
+  size_t blocks_;
+  AHVMmapArray<Block> data_;
+};
+
+#endif  // AHV_DEFENDER_AHV_BLOOM_FILTER_H_
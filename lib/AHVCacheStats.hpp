@@ -0,0 +1,94 @@
+#ifndef AHV_DEFENDER_AHV_CACHE_STATS_H_
+#define AHV_DEFENDER_AHV_CACHE_STATS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+// Counters and sizes of one cache shard (see AHVCache_Base::GetStats). The
+// counters run from the start of the process, the sizes are current.
+struct AHVCacheShardStats {
+  // Finds by number of candidates, the last bucket counts the finds with
+  // CANDIDATE_BUCKETS - 1 or more.
+  static constexpr int CANDIDATE_BUCKETS = 8;
+  // Rebuilds by duration: bucket 0 counts the ones under 1ms, bucket i the
+  // ones of [2^(i-1), 2^i) ms, the last bucket all the longer ones too.
+  static constexpr int DURATION_BUCKETS = 16;
+
+  int64_t finds = 0;
+  int64_t candidates = 0;
+  // Candidates verification rejected: false positives, each a wasted store
+  // read unless verifying in memory.
+  int64_t rejected = 0;
+  int64_t serving_size = 0;
+  int64_t delta_add_size = 0;
+  int64_t delta_remove_size = 0;
+  int64_t bytes = 0;
+  int64_t rebuilds = 0;
+  int64_t rebuild_ms = 0;
+  int64_t candidate_histogram[CANDIDATE_BUCKETS] = {};
+  int64_t rebuild_histogram[DURATION_BUCKETS] = {};
+
+  static int CandidateBucket(int candidates) {
+    return std::min(candidates, CANDIDATE_BUCKETS - 1);
+  }
+
+  static int DurationBucket(int64_t ms) {
+    return ms <= 0 ? 0 : std::min(64 - __builtin_clzll((uint64_t) ms), DURATION_BUCKETS - 1);
+  }
+
+  // Adds the counters and sizes of other, e.g. to sum up the shards.
+  void Merge(const AHVCacheShardStats& other) {
+    finds += other.finds;
+    candidates += other.candidates;
+    rejected += other.rejected;
+    serving_size += other.serving_size;
+    delta_add_size += other.delta_add_size;
+    delta_remove_size += other.delta_remove_size;
+    bytes += other.bytes;
+    rebuilds += other.rebuilds;
+    rebuild_ms += other.rebuild_ms;
+    for (int i = 0; i < CANDIDATE_BUCKETS; ++i) {
+      candidate_histogram[i] += other.candidate_histogram[i];
+    }
+    for (int i = 0; i < DURATION_BUCKETS; ++i) {
+      rebuild_histogram[i] += other.rebuild_histogram[i];
+    }
+  }
+};
+
+// Lookup counters of one shard kept by a single thread (see AHVPerThread):
+// only that thread writes them, with plain loads and stores rather than
+// read-modify-writes, other threads read them to sum up the statistics.
+struct AHVCacheLookupCounters {
+  std::atomic<int64_t> candidates{0};
+  std::atomic<int64_t> rejected{0};
+  std::atomic<int64_t> candidate_histogram[AHVCacheShardStats::CANDIDATE_BUCKETS]{};
+
+  void CountFind(int found) {
+    Increment(&candidate_histogram[AHVCacheShardStats::CandidateBucket(found)], 1);
+    Increment(&candidates, found);
+  }
+
+  void CountRejected(int count) {
+    Increment(&rejected, count);
+  }
+
+  // Adds the counters to the ones of stats.
+  void AddTo(AHVCacheShardStats* stats) const {
+    for (int i = 0; i < AHVCacheShardStats::CANDIDATE_BUCKETS; ++i) {
+      int64_t finds = candidate_histogram[i].load(std::memory_order_relaxed);
+      stats->candidate_histogram[i] += finds;
+      stats->finds += finds;
+    }
+    stats->candidates += candidates.load(std::memory_order_relaxed);
+    stats->rejected += rejected.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static void Increment(std::atomic<int64_t>* counter, int64_t value) {
+    counter->store(counter->load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+};
+
+#endif  // AHV_DEFENDER_AHV_CACHE_STATS_H_
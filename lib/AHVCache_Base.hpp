@@ -1,13 +1,73 @@
 #ifndef AHV_DEFENDER_AHV_CACHE_BASE_H_
 #define AHV_DEFENDER_AHV_CACHE_BASE_H_
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
+#include "AHVCacheStats.hpp"
+#include "AHVCandidates.hpp"
+#include "AHVHash.hpp"
+#include "AHVSnapshot.hpp"
+
+// Implementations are safe to call from multiple threads.
 class AHVCache_Base {
  public:
-  virtual void Add(const std::string& hash, int64_t record_index, bool quick = false) = 0;
-  virtual void Remove(const std::string& hash, int64_t record_index) = 0;
-  virtual void Find(const std::string& hash, int64_t** possible_indexes, int* count) = 0;
+  virtual ~AHVCache_Base() = default;
+
+  // Hint that about count entries are about to be added.
+  virtual void Reserve(int64_t count) { }
+
+  // Bulk loading, before the first Add: StartLoad, then each of the parts is
+  // loaded by its own thread with LoadPart, then FinishLoad. Each part gets
+  // ascending record indexes, above the ones of the parts before it. Records
+  // may only be found once FinishLoad returned. By default they are simply
+  // added.
+  virtual void StartLoad(int parts) { }
+
+  virtual void LoadPart(int part, const AHVHash& hash, int64_t record_index) {
+    Add(hash, record_index, true);
+  }
+
+  virtual void FinishLoad() { }
+
+  virtual void Add(const AHVHash& hash, int64_t record_index, bool quick = false) = 0;
+  virtual void Remove(const AHVHash& hash, int64_t record_index) = 0;
+
+  // Clears candidates, then fills it with the record indexes that might hold
+  // hash. Does not allocate.
+  virtual void Find(const AHVHash& hash, AHVCandidates* candidates) = 0;
+
+  // Find for count hashes at once, candidates[i] gets the candidates of
+  // hashes[i]. Implementations may overlap the memory accesses of the
+  // lookups.
+  virtual void FindBatch(const AHVHash* hashes, int count, AHVCandidates* candidates) {
+    for (int i = 0; i < count; ++i) {
+      Find(hashes[i], &candidates[i]);
+    }
+  }
+
+  // Tells the cache that verification rejected rejected of the candidates
+  // Find returned for hash, so that it can count its false positives.
+  virtual void CountRejected(const AHVHash& hash, int rejected) { }
+
+  // Counters and sizes of each shard, empty if the cache keeps none.
+  virtual std::vector<AHVCacheShardStats> GetStats() {
+    return std::vector<AHVCacheShardStats>();
+  }
+
+  // Writes the contents of the cache to a snapshot file tagged with info.
+  // Returns false if the cache does not support snapshots or on errors.
+  virtual bool WriteSnapshot(const std::string& filename, const AHVSnapshotInfo& info) {
+    return false;
+  }
+
+  // Replaces the contents of the cache with a snapshot and sets info. Only
+  // before the first add. Returns false, leaving the cache unchanged, if the
+  // cache does not support snapshots or the file is missing or unusable.
+  virtual bool ReadSnapshot(const std::string& filename, AHVSnapshotInfo* info) {
+    return false;
+  }
 };
 
-#endif  // AHV_DEFENDER_AHV_CACHE_BASE_H_
\ No newline at end of file
+#endif  // AHV_DEFENDER_AHV_CACHE_BASE_H_
@@ -0,0 +1,289 @@
+#ifndef AHV_DEFENDER_AHV_CACHE_CUCKOO_H_
+#define AHV_DEFENDER_AHV_CACHE_CUCKOO_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <vector>
+
+#include "AHVCache_Base.hpp"
+#include "AHVHash.hpp"
+#include "AHVMmapArray.hpp"
+
+// Cuckoo filter holding a record index next to each fingerprint. Sharded 256
+// ways on byte 0 of the hash like the radix cache, each shard is a table of
+// buckets of 4 slots, a slot being a 16 bit fingerprint, a 32 bit record
+// index and an 8 bit tag (7 bytes). An entry lives in one of two buckets: the
+// first is picked by hash bytes 1-8, the second by the first and the
+// fingerprint (partial key cuckoo hashing), so entries can be moved without
+// knowing their hash.
+//
+// Find reads 2 buckets and Remove clears a slot, there is nothing to compact.
+// A lookup gets a false candidate with probability about 8 / 2^16.
+//
+// A shard that fills up is rehashed into a single table twice the size, under
+// its write lock. The bucket of an entry only tells the low bits of its first
+// bucket, the tag keeps the rest: whether the entry sits in its second bucket
+// and the next TAG_BITS bucket bits, so a shard can grow to 2^TAG_BITS times
+// its first table (Reserve sizes that one from the store). Past that a full
+// shard chains a second table, which doubles the buckets its lookups read.
+class AHVCache_Cuckoo : public AHVCache_Base {
+ public:
+  void Reserve(int64_t count) override {
+    int64_t buckets = MIN_BUCKETS;
+    while (buckets * SLOTS * MAX_LOAD_PERCENT / 100 < count / 256) {
+      buckets *= 2;
+    }
+    for (Shard& shard : shards_) {
+      std::unique_lock<std::shared_mutex> lock(shard.mutex);
+      if (shard.tables.empty() || (shard.tables.size() == 1 && shard.tables[0]->size == 0)) {
+        shard.tables.clear();
+        shard.tables.emplace_back(new Table(buckets));
+        shard.tag_shift = BitWidth(buckets - 1);
+      }
+    }
+  }
+
+  void Add(const AHVHash& hash, int64_t record_index, bool quick = false) override {
+    if (record_index < 0 || record_index > UINT32_MAX) {
+      std::cerr << "Record index " << record_index << " does not fit the cuckoo cache." << std::endl;
+      exit(1);
+    }
+    Shard& shard = shards_[hash.data[0]];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    if (shard.tables.empty()) {
+      shard.tables.emplace_back(new Table(MIN_BUCKETS));
+      shard.tag_shift = BitWidth(MIN_BUCKETS - 1);
+    }
+    uint64_t bucket = BucketBits(hash);
+    uint16_t fingerprint = Fingerprint(hash);
+    uint8_t extra = (uint8_t) ((bucket >> shard.tag_shift) & TAG_MASK);
+    // Grows until the entry fits, at worst into an empty chained table.
+    while (!shard.tables.back()->Insert(bucket, fingerprint, (uint32_t) record_index, extra, &shard.mt)) {
+      Grow(&shard);
+    }
+  }
+
+  void Remove(const AHVHash& hash, int64_t record_index) override {
+    Shard& shard = shards_[hash.data[0]];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    uint64_t bucket = BucketBits(hash);
+    uint16_t fingerprint = Fingerprint(hash);
+    for (auto& table : shard.tables) {
+      if (table->Erase(bucket, fingerprint, (uint32_t) record_index)) return;
+    }
+  }
+
+  void Find(const AHVHash& hash, AHVCandidates* candidates) override {
+    candidates->Clear();
+    Shard& shard = shards_[hash.data[0]];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    uint64_t bucket = BucketBits(hash);
+    uint16_t fingerprint = Fingerprint(hash);
+    for (auto& table : shard.tables) {
+      table->Find(bucket, fingerprint, candidates);
+    }
+  }
+
+ private:
+  static const int SLOTS = 4;
+  static const int64_t MIN_BUCKETS = 1024;
+  // Bucketized cuckoo tables of 4 slots fill to about 95% before inserts
+  // start failing, Reserve leaves some room.
+  static const int MAX_LOAD_PERCENT = 90;
+  static const int MAX_KICKS = 500;
+  // Bucket bits kept in the tag of each slot, above the bits of the first
+  // table of its shard.
+  static const int TAG_BITS = 7;
+  static const uint64_t TAG_MASK = (1 << TAG_BITS) - 1;
+
+  // A fingerprint of 0 marks an empty slot. Tags hold the extra bucket bits
+  // above bit 0, which is set if the entry sits in its second bucket.
+  struct Bucket {
+    uint16_t fingerprints[SLOTS];
+    uint32_t indexes[SLOTS];
+    uint8_t tags[SLOTS];
+  };
+
+  class Table {
+   public:
+    // Fresh mappings are zeroed, all the slots start empty.
+    explicit Table(int64_t bucket_count)
+        : buckets(bucket_count), mask(bucket_count - 1), size(0) { }
+
+    void Find(uint64_t bucket_bits, uint16_t fingerprint, AHVCandidates* candidates) const {
+      uint64_t first = bucket_bits & mask;
+      uint64_t second = Alternate(first, fingerprint);
+      FindInBucket(buckets[first], fingerprint, candidates);
+      if (second != first) {
+        FindInBucket(buckets[second], fingerprint, candidates);
+      }
+    }
+
+    // Places the entry, moving others to their alternate buckets if both of
+    // its buckets are full. extra holds the TAG_BITS bucket bits past the
+    // ones of the first table. Returns false, with the table unchanged, if no
+    // room was found within MAX_KICKS moves.
+    bool Insert(uint64_t bucket_bits, uint16_t fingerprint, uint32_t index, uint8_t extra, std::mt19937* mt) {
+      uint64_t first = bucket_bits & mask;
+      uint64_t second = Alternate(first, fingerprint);
+      uint8_t tag = extra << 1;
+      if (InsertInBucket(first, fingerprint, index, tag) || InsertInBucket(second, fingerprint, index, tag | 1)) {
+        ++size;
+        return true;
+      }
+      // Kick out random entries, remembering the swaps to undo them. An
+      // entry moved to its alternate bucket flips its tag bit 0.
+      std::vector<std::pair<uint64_t, int>> swaps;
+      uint64_t current = first;
+      if ((*mt)() % 2 == 1) {
+        current = second;
+        tag |= 1;
+      }
+      for (int kick = 0; kick < MAX_KICKS; ++kick) {
+        int slot = (*mt)() % SLOTS;
+        Swap(current, slot, &fingerprint, &index, &tag);
+        swaps.emplace_back(current, slot);
+        current = Alternate(current, fingerprint);
+        tag ^= 1;
+        if (InsertInBucket(current, fingerprint, index, tag)) {
+          ++size;
+          return true;
+        }
+      }
+      for (auto it = swaps.rbegin(); it != swaps.rend(); ++it) {
+        tag ^= 1;
+        Swap(it->first, it->second, &fingerprint, &index, &tag);
+      }
+      return false;
+    }
+
+    // Calls f(bucket bits, fingerprint, index, extra) for every entry, the
+    // bucket bits being those of its first bucket in this table.
+    template <typename F>
+    void ForEach(int tag_shift, F f) const {
+      for (uint64_t b = 0; b < buckets.size(); ++b) {
+        for (int i = 0; i < SLOTS; ++i) {
+          uint16_t fingerprint = buckets[b].fingerprints[i];
+          if (fingerprint == 0) continue;
+          uint8_t tag = buckets[b].tags[i];
+          uint64_t first = (tag & 1) ? Alternate(b, fingerprint) : b;
+          uint64_t extra = tag >> 1;
+          f(first | (extra << tag_shift), fingerprint, buckets[b].indexes[i], (uint8_t) extra);
+        }
+      }
+    }
+
+    bool Erase(uint64_t bucket_bits, uint16_t fingerprint, uint32_t index) {
+      uint64_t first = bucket_bits & mask;
+      if (EraseInBucket(first, fingerprint, index) ||
+          EraseInBucket(Alternate(first, fingerprint), fingerprint, index)) {
+        --size;
+        return true;
+      }
+      return false;
+    }
+
+    AHVMmapArray<Bucket> buckets;
+    uint64_t mask;
+    int64_t size;
+
+   private:
+    // Involution: the alternate of the alternate is the bucket itself.
+    uint64_t Alternate(uint64_t bucket, uint16_t fingerprint) const {
+      return (bucket ^ ((uint64_t) fingerprint * 0x5bd1e995)) & mask;
+    }
+
+    static void FindInBucket(const Bucket& bucket, uint16_t fingerprint, AHVCandidates* candidates) {
+      for (int i = 0; i < SLOTS; ++i) {
+        if (bucket.fingerprints[i] == fingerprint) {
+          candidates->Add((int64_t) bucket.indexes[i]);
+        }
+      }
+    }
+
+    bool InsertInBucket(uint64_t bucket, uint16_t fingerprint, uint32_t index, uint8_t tag) {
+      for (int i = 0; i < SLOTS; ++i) {
+        if (buckets[bucket].fingerprints[i] == 0) {
+          buckets[bucket].fingerprints[i] = fingerprint;
+          buckets[bucket].indexes[i] = index;
+          buckets[bucket].tags[i] = tag;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void Swap(uint64_t bucket, int slot, uint16_t* fingerprint, uint32_t* index, uint8_t* tag) {
+      std::swap(*fingerprint, buckets[bucket].fingerprints[slot]);
+      std::swap(*index, buckets[bucket].indexes[slot]);
+      std::swap(*tag, buckets[bucket].tags[slot]);
+    }
+
+    bool EraseInBucket(uint64_t bucket, uint16_t fingerprint, uint32_t index) {
+      for (int i = 0; i < SLOTS; ++i) {
+        if (buckets[bucket].fingerprints[i] == fingerprint && buckets[bucket].indexes[i] == index) {
+          buckets[bucket].fingerprints[i] = 0;
+          return true;
+        }
+      }
+      return false;
+    }
+  };
+
+  struct Shard {
+    std::vector<std::unique_ptr<Table>> tables;
+    int tag_shift = 0;  // Bucket bits of the first table, below the tag bits.
+    std::mt19937 mt;
+    std::shared_mutex mutex;
+  };
+
+  // Rehashes a shard whose only table is full into one twice as large (four
+  // times if inserts still fail, and so on), or chains a new table once the
+  // tags have no bits left for a larger one.
+  static void Grow(Shard* shard) {
+    const Table& full = *shard->tables.back();
+    int64_t bucket_count = full.buckets.size() * 2;
+    for (; shard->tables.size() == 1 && BitWidth(bucket_count - 1) <= shard->tag_shift + TAG_BITS;
+         bucket_count *= 2) {
+      std::unique_ptr<Table> table(new Table(bucket_count));
+      bool ok = true;
+      full.ForEach(shard->tag_shift, [&] (uint64_t bucket_bits, uint16_t fingerprint, uint32_t index,
+                                          uint8_t extra) -> void {
+        ok = ok && table->Insert(bucket_bits, fingerprint, index, extra, &shard->mt);
+      });
+      if (ok) {
+        shard->tables.back() = std::move(table);
+        return;
+      }
+    }
+    shard->tables.emplace_back(new Table(full.buckets.size() * 2));
+  }
+
+  static int BitWidth(uint64_t value) {
+    return value == 0 ? 0 : 64 - __builtin_clzll(value);
+  }
+
+  // Bytes 1-8 pick the first bucket, disjoint from the shard bits.
+  static uint64_t BucketBits(const AHVHash& hash) {
+    uint64_t bits;
+    memcpy((char*) &bits, hash.data + 1, 8);
+    return bits;
+  }
+
+  // Bytes 9-10, never 0.
+  static uint16_t Fingerprint(const AHVHash& hash) {
+    uint16_t fingerprint;
+    memcpy((char*) &fingerprint, hash.data + 9, 2);
+    return fingerprint == 0 ? 1 : fingerprint;
+  }
+
+  Shard shards_[256];
+};
+
+#endif  // AHV_DEFENDER_AHV_CACHE_CUCKOO_H_
@@ -1,38 +1,241 @@
 #ifndef AHV_DEFENDER_AHV_CACHE_HASH_MAP_H_
 #define AHV_DEFENDER_AHV_CACHE_HASH_MAP_H_
 
-#include <string>
-#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "AHVCache_Base.hpp"
+#include "AHVHash.hpp"
+#include "AHVMmapArray.hpp"
 
+// Exact cache: the full hash and record index of every entry, in flat open
+// addressing tables (Swiss table style) without any allocation per entry.
+// Sharded 256 ways on byte 0 of the hash like the other caches, each shard
+// behind a reader / writer lock.
+//
+// Slots (a hash and a 40 bit record index, 28 bytes) come in groups of 16,
+// next to a control byte per slot: 0 for an empty slot, 1 for a removed one,
+// 0x80 and 7 hash bits for a used one. A lookup starts at the group picked by
+// hash bytes 1-8 and compares the 16 control bytes of a group at once,
+// only reading the slots whose 7 bits match, then moves on to the next group
+// until it reaches one with an empty slot. About 1 in 128 lookups of an
+// absent hash reads a slot. Tables grow by doubling once 7/8 of their slots
+// are used or removed; Reserve sizes them for a 3/4 load, so that loading does
+// not have to, at about 39 bytes per entry.
 class AHVCache_HashMap : public AHVCache_Base {
  public:
-  void Add(const std::string& hash, int64_t record_index, bool quick = false) override {
-    m_[hash] = record_index;
+  void Reserve(int64_t count) override {
+    int64_t groups = std::max(MIN_GROUPS, count / 256 * 4 / 3 / GROUP_SIZE + 1);
+    for (Shard& shard : shards_) {
+      std::unique_lock<std::shared_mutex> lock(shard.mutex);
+      if (shard.table == nullptr || shard.table->used == 0) {
+        shard.table.reset(new Table(groups));
+      }
+    }
   }
 
-  void Remove(const std::string& hash, int64_t record_index) override {
-    if (m_[hash] != record_index) {
+  // Replaces the record index of a hash already in the cache.
+  void Add(const AHVHash& hash, int64_t record_index, bool quick = false) override {
+    if (record_index < 0 || record_index > MAX_INDEX) {
+      std::cerr << "Record index " << record_index << " does not fit the hash map cache." << std::endl;
       exit(1);
     }
-    m_.erase(hash);
+    Shard& shard = shards_[hash.data[0]];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    if (shard.table == nullptr) {
+      shard.table.reset(new Table(MIN_GROUPS));
+    }
+    uint64_t position_bits = PositionBits(hash);
+    uint8_t control = Control(hash);
+    int64_t position = shard.table->Find(position_bits, control, hash);
+    if (position >= 0) {
+      shard.table->slots[position].SetIndex(record_index);
+      return;
+    }
+    if (shard.table->used + shard.table->removed + 1 > shard.table->capacity() * MAX_LOAD_EIGHTHS / 8) {
+      Rehash(&shard);
+    }
+    shard.table->Insert(position_bits, control, hash, record_index);
+  }
+
+  // Only removes the hash if it is held for record_index.
+  void Remove(const AHVHash& hash, int64_t record_index) override {
+    Shard& shard = shards_[hash.data[0]];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    if (shard.table == nullptr) return;
+    int64_t position = shard.table->Find(PositionBits(hash), Control(hash), hash);
+    if (position >= 0 && shard.table->slots[position].Index() == record_index) {
+      shard.table->Erase(position);
+    }
   }
 
-  void Find(const std::string& hash, int64_t** possible_indexes, int* count) override {
-    auto it = m_.find(hash);
-    if (it == m_.end()) {
-      *count = 0;
-      *possible_indexes = new int64_t[0];
-    } else {
-      *count = 1;
-      *possible_indexes = new int64_t[1];
-      (*possible_indexes)[0] = it->second;
+  void Find(const AHVHash& hash, AHVCandidates* candidates) override {
+    candidates->Clear();
+    Shard& shard = shards_[hash.data[0]];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    if (shard.table == nullptr) return;
+    int64_t position = shard.table->Find(PositionBits(hash), Control(hash), hash);
+    if (position >= 0) {
+      candidates->Add(shard.table->slots[position].Index());
     }
   }
 
  private:
-  std::unordered_map<std::string, int64_t> m_;
+  static constexpr int GROUP_SIZE = 16;
+  static constexpr int64_t MIN_GROUPS = 64;
+  static constexpr int MAX_LOAD_EIGHTHS = 7;
+  static constexpr int INDEX_BYTES = 5;
+  static constexpr int64_t MAX_INDEX = ((int64_t) 1 << (8 * INDEX_BYTES)) - 1;
+
+  static constexpr uint8_t EMPTY = 0x00;
+  static constexpr uint8_t REMOVED = 0x01;
+
+  struct Slot {
+    int64_t Index() const {
+      uint64_t record_index = 0;
+      memcpy(&record_index, index, INDEX_BYTES);
+      return (int64_t) record_index;
+    }
+
+    void SetIndex(int64_t record_index) {
+      memcpy(index, &record_index, INDEX_BYTES);
+    }
+
+    AHVHash hash;
+    unsigned char index[INDEX_BYTES];  // Little endian.
+  };
+
+  static_assert(sizeof(Slot) == AHV_HASH_LEN + INDEX_BYTES, "slots must not be padded");
+
+  class Table {
+   public:
+    // Fresh mappings are zeroed, all the slots start empty.
+    explicit Table(int64_t group_count)
+        : controls(group_count * GROUP_SIZE), slots(group_count * GROUP_SIZE),
+          groups(group_count), used(0), removed(0) { }
+
+    int64_t capacity() const {
+      return groups * GROUP_SIZE;
+    }
+
+    // Position of the slot holding hash, -1 if there is none.
+    int64_t Find(uint64_t position_bits, uint8_t control, const AHVHash& hash) const {
+      for (uint64_t group = FirstGroup(position_bits); ; group = NextGroup(group)) {
+        const uint8_t* group_controls = &controls[group * GROUP_SIZE];
+        for (uint32_t matches = Match(group_controls, control); matches != 0; matches &= matches - 1) {
+          int64_t position = group * GROUP_SIZE + __builtin_ctz(matches);
+          if (slots[position].hash == hash) return position;
+        }
+        if (Match(group_controls, EMPTY) != 0) return -1;
+      }
+    }
+
+    // Stores the entry in the first empty or removed slot it probes. The hash
+    // must not be in the table yet and the table must have an empty slot.
+    void Insert(uint64_t position_bits, uint8_t control, const AHVHash& hash, int64_t record_index) {
+      for (uint64_t group = FirstGroup(position_bits); ; group = NextGroup(group)) {
+        const uint8_t* group_controls = &controls[group * GROUP_SIZE];
+        uint32_t free = Match(group_controls, EMPTY) | Match(group_controls, REMOVED);
+        if (free != 0) {
+          int64_t position = group * GROUP_SIZE + __builtin_ctz(free);
+          if (controls[position] == REMOVED) --removed;
+          controls[position] = control;
+          slots[position].hash = hash;
+          slots[position].SetIndex(record_index);
+          ++used;
+          return;
+        }
+      }
+    }
+
+    // Lookups only probe past a group without empty slots, so a slot of a
+    // group that still has one can be emptied, the others are marked removed.
+    void Erase(int64_t position) {
+      const uint8_t* group_controls = &controls[position / GROUP_SIZE * GROUP_SIZE];
+      if (Match(group_controls, EMPTY) != 0) {
+        controls[position] = EMPTY;
+      } else {
+        controls[position] = REMOVED;
+        ++removed;
+      }
+      --used;
+    }
+
+    AHVMmapArray<uint8_t> controls;
+    AHVMmapArray<Slot> slots;
+    uint64_t groups;
+    int64_t used;
+    int64_t removed;  // Slots marked removed, lookups still probe past them.
+
+   private:
+    // Any number of groups, the position bits are scaled to it.
+    uint64_t FirstGroup(uint64_t position_bits) const {
+      return (uint64_t) (((unsigned __int128) position_bits * groups) >> 64);
+    }
+
+    uint64_t NextGroup(uint64_t group) const {
+      return group + 1 == groups ? 0 : group + 1;
+    }
+
+    // Bit i is set if control byte i of the group equals control.
+    static uint32_t Match(const uint8_t* group_controls, uint8_t control) {
+#ifdef __SSE2__
+      __m128i group = _mm_load_si128((const __m128i*) group_controls);
+      return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) control)));
+#else
+      uint32_t matches = 0;
+      for (int i = 0; i < GROUP_SIZE; ++i) {
+        matches |= (uint32_t) (group_controls[i] == control) << i;
+      }
+      return matches;
+#endif
+    }
+  };
+
+  struct Shard {
+    std::unique_ptr<Table> table;  // Null until the first add.
+    std::shared_mutex mutex;
+  };
+
+  // Moves the entries of a full table to a new one, twice as large unless
+  // most of the load was removed slots.
+  void Rehash(Shard* shard) {
+    const Table& old_table = *shard->table;
+    int64_t groups = old_table.groups;
+    if (old_table.used * 2 >= old_table.capacity() * MAX_LOAD_EIGHTHS / 8) {
+      groups *= 2;
+    }
+    std::unique_ptr<Table> table(new Table(groups));
+    for (int64_t position = 0; position < old_table.capacity(); ++position) {
+      if (!(old_table.controls[position] & 0x80)) continue;
+      const Slot& slot = old_table.slots[position];
+      table->Insert(PositionBits(slot.hash), old_table.controls[position], slot.hash, slot.Index());
+    }
+    shard->table = std::move(table);
+  }
+
+  // Bytes 1-8 pick the first group, disjoint from the shard bits.
+  static uint64_t PositionBits(const AHVHash& hash) {
+    uint64_t bits;
+    memcpy((char*) &bits, hash.data + 1, 8);
+    return bits;
+  }
+
+  // 7 bits of byte 9, disjoint from the group bits.
+  static uint8_t Control(const AHVHash& hash) {
+    return 0x80 | (hash.data[9] & 0x7f);
+  }
+
+  Shard shards_[256];
 };
 
-  #endif  // AHV_DEFENDER_AHV_CACHE_HASH_MAP_H_
\ No newline at end of file
+#endif  // AHV_DEFENDER_AHV_CACHE_HASH_MAP_H_
@@ -1,48 +1,365 @@
 #ifndef AHV_DEFENDER_AHV_CACHE_RADIX_H_
 #define AHV_DEFENDER_AHV_CACHE_RADIX_H_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
 #include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
+#include "AHVCacheStats.hpp"
 #include "AHVCache_Base.hpp"
 #include "AHVCache_RadixBucket.hpp"
+#include "AHVCache_RadixOptions.hpp"
+#include "AHVCompactionScheduler.hpp"
+#include "AHVEpoch.hpp"
+#include "AHVHash.hpp"
+#include "AHVMmapArray.hpp"
+#include "AHVPerThread.hpp"
+#include "AHVSnapshot.hpp"
 
+// Thread safe: lookups take no lock, writes are serialized per shard (see
+// AHVCache_RadixBucket). Shards are compacted in the background while they
+// keep serving, as decided by AHVCompactionScheduler.
+//
+// The leading ShardBits of the hash select one of 2^ShardBits shards, the
+// next FingerprintBits are kept as the fingerprint, next to a record index of
+// IndexBits. Shard and fingerprint bits trade false candidates (each costs a
+// disk read) against memory and the largest record index: the defaults, 38
+// bits, give one false candidate per ~275 lookups at 1G entries, and 34
+// index bits address 16G records. Shard bits cost no entry bits, entries are
+// 4 bytes when fingerprint and index fit 32 bits (see AHVCache_RadixBucket),
+// but each shard costs about a kilobyte on its own. See below for the other
+// layouts.
+template <int ShardBits = 8, int FingerprintBits = 30, int IndexBits = 34>
 class AHVCache_Radix : public AHVCache_Base {
+  // The arrays of small shards come from the heap (see AHVMmapArray), 65536
+  // shards only map arrays of their own once they hold thousands of entries.
+  static_assert(ShardBits >= 1 && ShardBits <= 16, "between 2 and 65536 shards");
+  static_assert(ShardBits + FingerprintBits <= 64, "shard and fingerprint bits come from 8 bytes of the hash");
+
  public:
-  void Add(const std::string& hash, int64_t record_index, bool quick = false) override {
-    int32_t prefix, bucket, reduced_index;
-    EncodePrefix(hash, &prefix, &bucket);
-    EncodeReducedIndex(record_index, &reduced_index);
-    buckets[bucket].Add(prefix, reduced_index, quick);
-    buckets[bucket].MaybeRebuild(quick);
+  typedef AHVCache_RadixBucket<FingerprintBits, IndexBits, std::max(1024, (20 << 20) >> ShardBits)> Bucket;
+  typedef typename Bucket::Entry Entry;
+
+  explicit AHVCache_Radix(const AHVCache_RadixOptions& options = AHVCache_RadixOptions())
+      : buckets(new Bucket[SHARDS]), scheduler_(buckets.get(), SHARDS), counters_(SHARDS), reserved_(0) {
+    for (int b = 0; b < SHARDS; ++b) {
+      buckets[b].SetOptions(options);
+    }
+  }
+
+  // Only sizes the bulk load buffers.
+  void Reserve(int64_t count) override {
+    reserved_ = count;
+  }
+
+  void StartLoad(int parts) override {
+    size_t expected = reserved_ / parts / SHARDS;
+    for (int b = 0; b < SHARDS; ++b) {
+      buckets[b].StartLoad(parts, expected + expected / 8);
+    }
+  }
+
+  void LoadPart(int part, const AHVHash& hash, int64_t record_index) override {
+    uint32_t fingerprint;
+    int bucket;
+    EncodeFingerprint(hash, &fingerprint, &bucket);
+    CheckIndex(record_index);
+    buckets[bucket].LoadPart(part, fingerprint, record_index);
+  }
+
+  // Sorts the shards into their serving areas on all cores.
+  void FinishLoad() override {
+    auto start = std::chrono::high_resolution_clock::now();
+    std::atomic<int> next_bucket(0);
+    std::vector<std::thread> threads;
+    int thread_count = std::max(1, (int) std::thread::hardware_concurrency());
+    for (int t = 0; t < thread_count; ++t) {
+      threads.emplace_back([&] () -> void {
+        for (int b = next_bucket++; b < SHARDS; b = next_bucket++) {
+          buckets[b].FinishLoad();
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::cout << "Built " << SHARDS << " shards. Took "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count() << "ms." << std::endl;
+  }
+
+  void Add(const AHVHash& hash, int64_t record_index, bool quick = false) override {
+    uint32_t fingerprint;
+    int bucket;
+    EncodeFingerprint(hash, &fingerprint, &bucket);
+    CheckIndex(record_index);
+    buckets[bucket].Add(fingerprint, record_index, quick);
+    if (buckets[bucket].MaybeRebuild(quick)) {
+      scheduler_.Request(bucket);
+    }
+  }
+
+  void Remove(const AHVHash& hash, int64_t record_index) override {
+    uint32_t fingerprint;
+    int bucket;
+    EncodeFingerprint(hash, &fingerprint, &bucket);
+    buckets[bucket].Remove(fingerprint, record_index);
+    if (buckets[bucket].MaybeRebuild()) {
+      scheduler_.Request(bucket);
+    }
+  }
+
+  void Find(const AHVHash& hash, AHVCandidates* candidates) override {
+    uint32_t fingerprint;
+    int bucket;
+    EncodeFingerprint(hash, &fingerprint, &bucket);
+    candidates->Clear();
+    buckets[bucket].Find(fingerprint, candidates);
+    counters_.Local()[bucket].CountFind(candidates->size());
+  }
+
+  void CountRejected(const AHVHash& hash, int rejected) override {
+    uint32_t fingerprint;
+    int bucket;
+    EncodeFingerprint(hash, &fingerprint, &bucket);
+    counters_.Local()[bucket].CountRejected(rejected);
+  }
+
+  std::vector<AHVCacheShardStats> GetStats() override {
+    std::vector<AHVCacheShardStats> stats(SHARDS);
+    for (int b = 0; b < SHARDS; ++b) {
+      stats[b] = buckets[b].GetShardStats();
+    }
+    counters_.ForEach([&] (const AHVCacheLookupCounters* counters) -> void {
+      for (int b = 0; b < SHARDS; ++b) {
+        counters[b].AddTo(&stats[b]);
+      }
+    });
+    return stats;
   }
 
-  void Remove(const std::string& hash, int64_t record_index) override {
-    int32_t prefix, bucket, reduced_index;
-    EncodePrefix(hash, &prefix, &bucket);
-    EncodeReducedIndex(record_index, &reduced_index);
-    buckets[bucket].Remove(prefix, reduced_index);
-    buckets[bucket].MaybeRebuild();
+  // One section per shard, holding its live entries.
+  bool WriteSnapshot(const std::string& filename, const AHVSnapshotInfo& info) override {
+    std::string temporary = filename + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    AHVSnapshotHeader header = SnapshotHeader(info);
+    std::vector<AHVSnapshotSection> sections(SHARDS);
+    uint64_t offset = AlignSection(sizeof(header) + SHARDS * sizeof(AHVSnapshotSection));
+    bool ok = true;
+    for (int b = 0; b < SHARDS && ok; ++b) {
+      std::vector<Entry> entries = buckets[b].SnapshotEntries();
+      sections[b].offset = offset;
+      sections[b].size = entries.size();
+      sections[b].checksum = AHVChecksumWords(entries.data(), entries.size());
+      ok = AHVWriteAt(fd, entries.data(), entries.size() * sizeof(Entry), offset);
+      offset = AlignSection(offset + entries.size() * sizeof(Entry));
+    }
+    header.checksum = HeaderChecksum(header, sections);
+    // Padded to the end of the last section, so that every section, empty
+    // ones included, lies within the file.
+    ok = ok && ftruncate(fd, offset) == 0 &&
+         AHVWriteAt(fd, sections.data(), SHARDS * sizeof(AHVSnapshotSection), sizeof(header)) &&
+         AHVWriteAt(fd, &header, sizeof(header), 0) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), filename.c_str()) != 0) {
+      unlink(temporary.c_str());
+      return false;
+    }
+    return true;
   }
 
-  void Find(const std::string& hash, int64_t** possible_indexes, int* count) override {
-    int32_t prefix, bucket;
-    EncodePrefix(hash, &prefix, &bucket);
-    buckets[bucket].Find(prefix, possible_indexes, count);
-    buckets[bucket].MaybeRebuild();
+  // The sections are mapped in place (copy on write) and checked before any
+  // shard is replaced.
+  bool ReadSnapshot(const std::string& filename, AHVSnapshotInfo* info) override {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = ReadSnapshotSections(fd, info);
+    close(fd);
+    return ok;
+  }
+
+  // Lookups go through the shards in groups of GROUP_SIZE, interleaving the
+  // steps of their searches so that each group waits for memory about as
+  // long as a single lookup. Hashes are taken in shard order, so that
+  // lookups of the same shard share the top of its search index.
+  void FindBatch(const AHVHash* hashes, int count, AHVCandidates* candidates) override {
+    std::vector<int> order = ShardOrder(hashes, count);
+    AHVEpoch::Guard guard;
+    AHVCacheLookupCounters* counters = counters_.Local();
+    typename Bucket::Probe probes[GROUP_SIZE];
+    int group_buckets[GROUP_SIZE];
+    for (int first = 0; first < count; first += GROUP_SIZE) {
+      int size = std::min(GROUP_SIZE, count - first);
+      for (int i = 0; i < size; ++i) {
+        uint32_t fingerprint;
+        EncodeFingerprint(hashes[order[first + i]], &fingerprint, &group_buckets[i]);
+        buckets[group_buckets[i]].StartFind(fingerprint, &probes[i]);
+      }
+      bool stepping = true;
+      while (stepping) {
+        stepping = false;
+        for (int i = 0; i < size; ++i) {
+          stepping |= buckets[group_buckets[i]].StepFind(&probes[i]);
+        }
+      }
+      for (int i = 0; i < size; ++i) {
+        buckets[group_buckets[i]].PrefetchFind(probes[i]);
+      }
+      for (int i = 0; i < size; ++i) {
+        AHVCandidates* hash_candidates = &candidates[order[first + i]];
+        hash_candidates->Clear();
+        buckets[group_buckets[i]].FinishFind(&probes[i], hash_candidates);
+        counters[group_buckets[i]].CountFind(hash_candidates->size());
+      }
+    }
   }
 
  private:
-  void EncodePrefix(const std::string& hash, int32_t* prefix, int* bucket) {
-    *bucket = (int) ((unsigned char) *hash.c_str());
-    memcpy((char*) prefix, hash.c_str(), 4);
+  static constexpr int SHARDS = 1 << ShardBits;
+  static constexpr int GROUP_SIZE = 16;
+
+  // Positions of hashes sorted by shard: a counting sort, or a comparison
+  // sort for batches smaller than the shard count.
+  static std::vector<int> ShardOrder(const AHVHash* hashes, int count) {
+    std::vector<int> shards(count);
+    for (int i = 0; i < count; ++i) {
+      shards[i] = (int) (LeadingBits(hashes[i]) >> (64 - ShardBits));
+    }
+    if (count < SHARDS) {
+      std::vector<int> order(count);
+      for (int i = 0; i < count; ++i) {
+        order[i] = i;
+      }
+      std::stable_sort(order.begin(), order.end(), [&] (int a, int b) -> bool { return shards[a] < shards[b]; });
+      return order;
+    }
+    std::vector<int> starts(SHARDS + 1, 0);
+    for (int i = 0; i < count; ++i) {
+      ++starts[shards[i] + 1];
+    }
+    for (int b = 0; b < SHARDS; ++b) {
+      starts[b + 1] += starts[b];
+    }
+    std::vector<int> order(count);
+    for (int i = 0; i < count; ++i) {
+      order[starts[shards[i]]++] = i;
+    }
+    return order;
+  }
+
+  AHVSnapshotHeader SnapshotHeader(const AHVSnapshotInfo& info) const {
+    AHVSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AHV_SNAPSHOT_MAGIC, 8);
+    header.version = AHVSnapshotHeader::VERSION;
+    header.sections = SHARDS;
+    header.layout[0] = ShardBits;
+    header.layout[1] = FingerprintBits;
+    header.layout[2] = IndexBits;
+    header.info = info;
+    return header;
   }
 
-  void EncodeReducedIndex(int64_t record_index, int32_t* reduced_index) {
-    *reduced_index = record_index / 32;
+  static uint64_t HeaderChecksum(AHVSnapshotHeader header, const std::vector<AHVSnapshotSection>& sections) {
+    header.checksum = 0;
+    uint64_t checksum = AHVChecksum(&header, sizeof(header));
+    return AHVChecksum(sections.data(), sections.size() * sizeof(AHVSnapshotSection), checksum);
   }
 
-  AHVCache_RadixBucket buckets[256];
+  static uint64_t AlignSection(uint64_t offset) {
+    return (offset + AHVSnapshotHeader::ALIGNMENT - 1) / AHVSnapshotHeader::ALIGNMENT * AHVSnapshotHeader::ALIGNMENT;
+  }
+
+  bool ReadSnapshotSections(int fd, AHVSnapshotInfo* info) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) return false;
+    uint64_t file_size = file_stat.st_size;
+    AHVSnapshotHeader header;
+    std::vector<AHVSnapshotSection> sections(SHARDS);
+    if (!AHVReadAt(fd, &header, sizeof(header), 0)) return false;
+    AHVSnapshotHeader expected = SnapshotHeader(header.info);
+    if (memcmp(header.magic, expected.magic, 8) != 0 || header.version != expected.version ||
+        header.sections != expected.sections || memcmp(header.layout, expected.layout, sizeof(header.layout)) != 0) {
+      std::cerr << "Snapshot is of another version or cache layout, ignoring it." << std::endl;
+      return false;
+    }
+    if (!AHVReadAt(fd, sections.data(), SHARDS * sizeof(AHVSnapshotSection), sizeof(header)) ||
+        header.checksum != HeaderChecksum(header, sections)) {
+      std::cerr << "Snapshot header is corrupted, ignoring it." << std::endl;
+      return false;
+    }
+    std::vector<std::unique_ptr<AHVMmapArray<Entry>>> entries(SHARDS);
+    for (int b = 0; b < SHARDS; ++b) {
+      const AHVSnapshotSection& section = sections[b];
+      if (section.size > (uint64_t) INT32_MAX || section.offset % AHVSnapshotHeader::ALIGNMENT != 0 ||
+          section.offset + section.size * sizeof(Entry) > file_size) {
+        std::cerr << "Snapshot section " << b << " is out of bounds, ignoring the snapshot." << std::endl;
+        return false;
+      }
+      entries[b].reset(new AHVMmapArray<Entry>(fd, section.offset, section.size));
+      if (section.size > 0 && entries[b]->get() == nullptr) return false;
+      if (AHVChecksumWords(entries[b]->get(), section.size) != section.checksum) {
+        std::cerr << "Snapshot section " << b << " is corrupted, ignoring the snapshot." << std::endl;
+        return false;
+      }
+    }
+    for (int b = 0; b < SHARDS; ++b) {
+      buckets[b].LoadServing(std::move(entries[b]), (int) sections[b].size);
+    }
+    *info = header.info;
+    return true;
+  }
+
+  // First 8 bytes of the raw hash, byte 0 in the high bits.
+  static uint64_t LeadingBits(const AHVHash& hash) {
+    uint64_t bits;
+    memcpy((char*) &bits, hash.data, 8);
+    return __builtin_bswap64(bits);
+  }
+
+  // The leading bits of the hash select the shard, the fingerprint is taken
+  // from the bits that follow, disjoint from the shard bits.
+  void EncodeFingerprint(const AHVHash& hash, uint32_t* fingerprint, int* bucket) {
+    uint64_t bits = LeadingBits(hash);
+    *bucket = (int) (bits >> (64 - ShardBits));
+    *fingerprint = (uint32_t) ((bits << ShardBits) >> (64 - FingerprintBits));
+  }
+
+  // Record indexes are store slot numbers, packed next to the fingerprint.
+  void CheckIndex(int64_t record_index) {
+    if (record_index < 0 || record_index > Bucket::MAX_INDEX) {
+      std::cerr << "Record index " << record_index << " does not fit the radix cache." << std::endl;
+      exit(1);
+    }
+  }
+
+  std::unique_ptr<Bucket[]> buckets;
+
+  // Declared after the buckets, its workers stop before they are destructed.
+  AHVCompactionScheduler<Bucket> scheduler_;
+
+  // Lookup counters of each shard, an array per thread so that lookups on
+  // different cores write no shared cache line (SHARDS * 80 bytes a thread).
+  AHVPerThread<AHVCacheLookupCounters> counters_;
+
+  int64_t reserved_;  // Records expected by the bulk load.
 };
 
+// Layout picked at startup with lookup-server --cache=radix-wide: 1024 shards
+// and 32 bit fingerprints, 16x fewer false candidates (disk reads) than the
+// default, for up to 4G records.
+typedef AHVCache_Radix<10, 32, 32> AHVCache_RadixWide;
+
 #endif  // AHV_DEFENDER_AHV_CACHE_RADIX_H_
\ No newline at end of file
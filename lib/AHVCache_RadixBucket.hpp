@@ -2,191 +2,846 @@
 #define AHV_DEFENDER_AHV_CACHE_RADIX_BUCKET_H_
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <iostream>
-#include <set>
-#include <utility>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
 
+#include "AHVBloomFilter.hpp"
+#include "AHVCacheStats.hpp"
+#include "AHVCache_RadixOptions.hpp"
+#include "AHVCandidates.hpp"
+#include "AHVCompressedEntries.hpp"
+#include "AHVEpoch.hpp"
+#include "AHVMmapArray.hpp"
+#include "AHVSearchIndex.hpp"
+
+// One shard of the radix cache. Entries pack a hash fingerprint and a record
+// index into one sorted word, the fingerprint in the high bits:
+//
+//   | fingerprint (FingerprintBits) | record index (IndexBits) |
+//
+// Words are 32 bits wide if both fit, 64 bits otherwise.
+//
+// Adds go to the delta, which is compacted into the serving area once it holds
+// more than MaxDeltaSize entries or removals.
+//
+// Find takes no lock: it reads an immutable
+// View of the shard under an AHVEpoch::Guard. Add, Remove and rebuilds are
+// serialized by write_mutex and either update the view in place through
+// atomics (tombstones, appends to the pending buffer) or publish a new view
+// and retire the old one.
+//
+// Compaction runs in the background (see Compact): the delta is frozen, a new
+// serving area is built from the old one and the frozen delta while both keep
+// serving, then swapped in. Writes arriving meanwhile go to a fresh delta,
+// removals hitting the frozen parts are replayed onto the new serving area.
+template <int FingerprintBits, int IndexBits, int MaxDeltaSize>
 class AHVCache_RadixBucket {
+  static_assert(FingerprintBits <= 32 && FingerprintBits + IndexBits <= 64,
+                "entries are a 32 bit fingerprint at most and an index in 64 bits");
+
  public:
+  typedef typename std::conditional<FingerprintBits + IndexBits <= 32, uint32_t, uint64_t>::type Entry;
+
   AHVCache_RadixBucket() {
-    serving_prefixes = new int32_t[MAX_SERVING_SIZE];
-    serving_rindexes = new int32_t[MAX_SERVING_SIZE];
-    serving_size = 0;
+    view = new View{new Serving(0), nullptr, new Delta(std::vector<Entry>())};
+    compaction_requested = false;
+    compacting = false;
     last_rebuild_time = std::chrono::high_resolution_clock::now();
   }
 
   ~AHVCache_RadixBucket() {
-    delete[] serving_prefixes;
-    delete[] serving_rindexes;
+    View* v = view.load();
+    delete v->serving;
+    delete v->frozen;
+    delete v->delta;
+    delete v;
   }
 
-  int DeltaCount(const std::set<std::pair<int32_t, int32_t>> delta, int32_t prefix) {
-    auto lb = std::lower_bound(delta.begin(), delta.end(), std::make_pair(prefix, 0));
-    int c = 0;
-    for (auto it = lb; it != delta.end() && it->first == prefix; ++it) {
-      ++c;
-    }
-    return c;
+  // Applies to the serving areas built from now on, meant to be called
+  // before the first add.
+  void SetOptions(const AHVCache_RadixOptions& new_options) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    options = new_options;
+    // Rebuild the serving area with them.
+    View* v = view.load(std::memory_order_relaxed);
+    Serving* serving = BuildServing(*v->serving, Delta(std::vector<Entry>()));
+    FilterDelta(serving, *v->delta);
+    Publish(serving, v->frozen, v->delta);
   }
 
-  void DeltaFind(int32_t prefix, int64_t** possible_indexes, int* count) {
-    *count = DeltaCount(delta_add, prefix);
-    *possible_indexes = new int64_t[*count];
-    *count = 0;
-    auto lb = std::lower_bound(delta_add.begin(), delta_add.end(), std::make_pair(prefix, 0));
-    for (auto it = lb; it != delta_add.end() && it->first == prefix; ++it) {
-      (*possible_indexes)[*count] = (int64_t) 32 * (int64_t) it->second;
-      ++(*count);
+  static constexpr int FINGERPRINT_BITS = FingerprintBits;
+  static constexpr int INDEX_BITS = IndexBits;
+  static constexpr int64_t MAX_INDEX = ((int64_t) 1 << INDEX_BITS) - 1;
+  static constexpr int MAX_DELTA_SIZE = MaxDeltaSize;
+
+  void Add(uint32_t fingerprint, int64_t record_index, bool quick) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    View* v = view.load(std::memory_order_relaxed);
+    Entry p = MakeEntry(fingerprint, record_index);
+    if (!quick && !compacting) {
+      // Re-adding an entry removed from the serving area clears its
+      // tombstone rather than duplicating it in the delta. Not while
+      // compacting, the compaction may already have dropped the entry.
+      int position = ServingPosition(*v->serving, p, true);
+      if (position >= 0) {
+        v->serving->removed.Clear(position);
+        --v->serving->removed_count;
+        UpdateSizes();
+        return;
+      }
     }
+    Delta* delta = v->delta;
+    int count = delta->pending_count.load(std::memory_order_relaxed);
+    if (count == MAX_PENDING_SIZE) {
+      FlushPending();
+      v = view.load(std::memory_order_relaxed);
+      delta = v->delta;
+      count = 0;
+    }
+    // Readers only look at the first pending_count entries, publish the
+    // entry before the count, and the filter bits before the entry.
+    if (v->serving->filter != nullptr) {
+      v->serving->filter->Add(fingerprint);
+    }
+    delta->pending[count] = p;
+    delta->pending_count.store(count + 1, std::memory_order_release);
+    UpdateSizes();
   }
 
-  void CombineResults(int64_t* v1, int c1, int64_t* v2, int c2, int64_t** r, int* c) {
-    *r = new int64_t[c1 + c2];
-    *c = 0;
-    for (int i = 0; i < c1; ++i) {
-      (*r)[(*c)++] = v1[i];
+  void Remove(uint32_t fingerprint, int64_t record_index) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    View* v = view.load(std::memory_order_relaxed);
+    Entry p = MakeEntry(fingerprint, record_index);
+    int position = DeltaPosition(*v->delta, p);
+    if (position >= 0) {
+      v->delta->removed.Set(position);
+      return;
+    }
+    if (v->frozen != nullptr) {
+      position = DeltaPosition(*v->frozen, p);
+      if (position >= 0) {
+        v->frozen->removed.Set(position);
+        replay_removes.push_back(p);
+        return;
+      }
     }
-    for (int i = 0; i < c2; ++i) {
-      (*r)[(*c)++] = v2[i];
+    position = ServingPosition(*v->serving, p, false);
+    if (position >= 0) {
+      v->serving->removed.Set(position);
+      ++v->serving->removed_count;
+      UpdateSizes();
+      if (compacting) {
+        replay_removes.push_back(p);
+      }
     }
-    delete[] v1;
-    delete[] v2;
   }
 
-  void Add(int32_t prefix, int32_t reduced_index, bool quick) {
-    auto p = std::make_pair(prefix, reduced_index);
-    if (!quick && delta_remove.count(p) > 0) {
-      delta_remove.erase(p);
+  // Appends the candidates for fingerprint to the ones already in candidates.
+  void Find(uint32_t fingerprint, AHVCandidates* candidates) {
+    AHVEpoch::Guard guard;
+    const View* v = view.load();
+    if (!v->serving->MayContain(fingerprint)) return;
+    ServingFind(*v->serving, fingerprint, candidates);
+    if (v->frozen != nullptr) {
+      DeltaFind(*v->frozen, fingerprint, candidates);
     }
-    delta_add.insert(p);
+    DeltaFind(*v->delta, fingerprint, candidates);
   }
 
-  void Remove(int32_t prefix, int32_t reduced_index) {
-    auto p = std::make_pair(prefix, reduced_index);
-    if (delta_add.count(p) > 0) {
-      delta_add.erase(p);
+  // A Find split in steps, so that the cache misses of several lookups
+  // overlap (see AHVCache_Radix::FindBatch): StartFind, StepFind until it
+  // returns false, PrefetchFind, then FinishFind. The caller holds an
+  // AHVEpoch::Guard from StartFind to FinishFind.
+  struct Probe;
+
+  void StartFind(uint32_t fingerprint, Probe* probe) {
+    probe->view = view.load();
+    probe->fingerprint = fingerprint;
+    const Serving& serving = *probe->view->serving;
+    probe->filter_pending = serving.filter != nullptr;
+    probe->ruled_out = false;
+    if (probe->filter_pending) {
+      serving.filter->Prefetch(fingerprint);
     }
-    delta_remove.insert(p);
+    serving.index.Start(serving.SearchKey(fingerprint), &probe->cursor);
   }
 
-  void ServingFind(int32_t prefix, int64_t** possible_indexes, int* count) {
-    int32_t* start = serving_prefixes;
-    int32_t* end = serving_prefixes + serving_size;
-    int32_t* ptr = std::lower_bound(start, end, prefix);
-    int32_t* it = ptr;
-    while (it != end && *it == prefix) {
-      ++it;
-    }
-    int max_count = it - ptr;
-    *possible_indexes = new int64_t[max_count];
-    it = ptr;
-    int idx = ptr - start;
-    *count = 0;
-    for (int i = 0; i < max_count; ++i) {
-      if (delta_remove.count(std::make_pair(prefix, serving_rindexes[idx + i])) > 0) continue;
-      (*possible_indexes)[*count] = (int64_t) 32 * (int64_t) serving_rindexes[idx + i];
-      ++(*count);
-    }
+  bool StepFind(Probe* probe) {
+    if (!CheckFilter(probe)) return false;
+    return probe->view->serving->index.Step(&probe->cursor);
   }
 
-  void Find(int32_t prefix, int64_t** possible_indexes, int* count) {
-    int64_t *v1, *v2;
-    int c1, c2;
-    ServingFind(prefix, &v1, &c1);
-    DeltaFind(prefix, &v2, &c2);
-    CombineResults(v1, c1, v2, c2, possible_indexes, count);
+  void PrefetchFind(const Probe& probe) {
+    if (probe.ruled_out) return;
+    probe.view->serving->PrefetchBlock(probe.cursor);
   }
 
-  void MaybeRebuild(bool quick = false) {
-    if (delta_add.size() > MAX_DELTA_SIZE || delta_remove.size() > MAX_DELTA_SIZE) {
-      std::cout << "Deltas too large, rebuilding..." << std::endl;
+  // Appends the candidates of the probe to the ones already in candidates.
+  void FinishFind(Probe* probe, AHVCandidates* candidates) {
+    if (!CheckFilter(probe)) return;
+    const View* v = probe->view;
+    const Serving& serving = *v->serving;
+    size_t lower_bound = serving.Finish(&probe->cursor);
+    ServingCollect(serving, lower_bound, probe->fingerprint, candidates);
+    if (v->frozen != nullptr) {
+      DeltaFind(*v->frozen, probe->fingerprint, candidates);
+    }
+    DeltaFind(*v->delta, probe->fingerprint, candidates);
+  }
+
+  // Returns true if the deltas grew too large and the shard should be
+  // compacted in the background, only once per compaction. Quick adds (bulk
+  // loading, nobody is reading yet) merge the delta right away instead.
+  // Age based compactions are up to AHVCompactionScheduler.
+  bool MaybeRebuild(bool quick = false) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    if (compaction_requested || compacting) return false;
+    View* v = view.load(std::memory_order_relaxed);
+    int delta_add_size = v->delta->sorted.size() + v->delta->pending_count.load(std::memory_order_relaxed);
+    int delta_remove_size = v->serving->removed_count;
+    if (delta_add_size > MAX_DELTA_SIZE || delta_remove_size > MAX_DELTA_SIZE) {
       if (quick) {
-        QuickRebuild();
-      } else {
         Rebuild();
+        return false;
       }
-      return;
+      compaction_requested = true;
+      return true;
     }
+    return false;
+  }
 
-    auto now = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - last_rebuild_time);
-    if (duration.count() > 10 * 60 && (delta_add.size() > MAX_DELTA_SIZE_WITH_TIME || delta_remove.size() > MAX_DELTA_SIZE_WITH_TIME)) {
-      std::cout << "Too much time has passed, deltas not small enough..." << std::endl;
-      Rebuild();
-      return;
+  // Live entries of the shard, sorted, for snapshots.
+  std::vector<Entry> SnapshotEntries() {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    View* v = view.load(std::memory_order_relaxed);
+    std::vector<Entry> added = DeltaEntries(*v->delta);
+    if (v->frozen != nullptr) {
+      std::vector<Entry> frozen = DeltaEntries(*v->frozen);
+      std::vector<Entry> merged(added.size() + frozen.size());
+      std::merge(added.begin(), added.end(), frozen.begin(), frozen.end(), merged.begin());
+      added.swap(merged);
     }
+    std::vector<Entry> entries(LiveCount(*v->serving) + added.size());
+    entries.resize(MergeLive(*v->serving, added, entries.data()));
+    return entries;
   }
 
-  void Rebuild() {
-    auto start_time = std::chrono::high_resolution_clock::now();
-    // Accumulate from serving.
-    for (int i = 0; i < serving_size; ++i) {
-      delta_add.insert(std::make_pair(serving_prefixes[i], serving_rindexes[i]));
+  // Replaces the contents of the shard with size sorted entries, as read
+  // from a snapshot. Meant to be called before the first add.
+  void LoadServing(std::unique_ptr<AHVMmapArray<Entry>> entries, int size) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    Serving* serving = new Serving(std::move(entries), size);
+    serving->Seal(options);
+    Publish(serving, nullptr, new Delta(std::vector<Entry>()));
+    last_rebuild_time = std::chrono::high_resolution_clock::now();
+  }
+
+  // Bulk loading (see AHVCache_Base::StartLoad): entries are gathered per
+  // part without locking, each part is only loaded by one thread.
+  void StartLoad(int parts, size_t expected_part_size) {
+    load_parts.assign(parts, std::vector<Entry>());
+    for (std::vector<Entry>& part : load_parts) {
+      part.reserve(expected_part_size);
     }
+  }
 
-    // Apply delta remove.
-    for (auto it = delta_remove.begin(); it != delta_remove.end(); ++it) {
-      delta_add.erase(*it);
+  void LoadPart(int part, uint32_t fingerprint, int64_t record_index) {
+    load_parts[part].push_back(MakeEntry(fingerprint, record_index));
+  }
+
+  // Builds the serving area out of the loaded entries and whatever the shard
+  // already holds (a snapshot). The parts put one after the other are in
+  // record index order, so a stable radix sort on the fingerprint alone
+  // sorts the entries.
+  void FinishLoad() {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    size_t size = 0;
+    for (const std::vector<Entry>& part : load_parts) {
+      size += part.size();
+    }
+    std::unique_ptr<AHVMmapArray<Entry>> loaded(new AHVMmapArray<Entry>(size));
+    size_t position = 0;
+    for (std::vector<Entry>& part : load_parts) {
+      std::copy(part.begin(), part.end(), loaded->get() + position);
+      position += part.size();
+      std::vector<Entry>().swap(part);
+    }
+    load_parts.clear();
+    {
+      std::unique_ptr<AHVMmapArray<Entry>> buffer(new AHVMmapArray<Entry>(size));
+      if (SortByFingerprint(loaded->get(), buffer->get(), size) != loaded->get()) {
+        loaded.swap(buffer);
+      }
     }
 
-    // Offload to serving.
-    serving_size = 0;
-    for (auto it = delta_add.begin(); it != delta_add.end(); ++it) {
-      serving_prefixes[serving_size] = it->first;
-      serving_rindexes[serving_size] = it->second;
-      ++serving_size;
+    View* v = view.load(std::memory_order_relaxed);
+    std::vector<Entry> added = DeltaEntries(*v->delta);
+    Serving* serving;
+    if (v->serving->size == 0 && added.empty()) {
+      serving = new Serving(std::move(loaded), size);
+      serving->Seal(options);
+    } else {
+      std::vector<Entry> merged(added.size() + size);
+      std::merge(added.begin(), added.end(), loaded->get(), loaded->get() + size, merged.begin());
+      loaded.reset();
+      serving = BuildServing(*v->serving, merged);
     }
-    delta_add.clear();
-    delta_remove.clear();
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-    std::cout << "Rebuilt shard. Took " << duration.count() << "ms." << std::endl;
+    Publish(serving, nullptr, new Delta(std::vector<Entry>()));
     last_rebuild_time = std::chrono::high_resolution_clock::now();
   }
 
-  void QuickRebuild() {
+  struct Stats {
+    int64_t serving_size;
+    int64_t delta_size;  // Adds and removals not compacted yet.
+    int64_t compaction_memory;  // Bytes a compaction would allocate.
+    bool compacting;
+    std::chrono::time_point<std::chrono::high_resolution_clock> last_rebuild_time;
+  };
+
+  // Takes no lock, the scheduler polls every shard: the sizes are the ones
+  // left by the last write.
+  Stats GetStats() const {
+    Stats stats;
+    stats.serving_size = serving_size.load(std::memory_order_relaxed);
+    stats.delta_size = delta_size.load(std::memory_order_relaxed);
+    // The merged entries, then the new serving area.
+    stats.compaction_memory = (stats.serving_size + stats.delta_size) * 2 * sizeof(Entry);
+    stats.compacting = compacting.load(std::memory_order_relaxed);
+    stats.last_rebuild_time = last_rebuild_time.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  AHVCacheShardStats GetShardStats() {
+    AHVCacheShardStats stats;
+    std::lock_guard<std::mutex> lock(write_mutex);
+    View* v = view.load(std::memory_order_relaxed);
+    stats.serving_size = v->serving->size;
+    stats.delta_add_size = v->delta->sorted.size() + v->delta->pending_count.load(std::memory_order_relaxed);
+    stats.delta_remove_size = v->serving->removed_count;
+    stats.bytes = ServingBytes(*v->serving) + DeltaBytes(*v->delta);
+    if (v->frozen != nullptr) {
+      stats.delta_add_size += v->frozen->sorted.size() + v->frozen->pending_count.load(std::memory_order_relaxed);
+      stats.bytes += DeltaBytes(*v->frozen);
+    }
+    stats.rebuilds = rebuilds;
+    stats.rebuild_ms = rebuild_ms;
+    std::copy(rebuild_histogram, rebuild_histogram + AHVCacheShardStats::DURATION_BUCKETS,
+              stats.rebuild_histogram);
+    return stats;
+  }
+
+  // Rebuilds the serving area while the shard keeps serving. Meant to run on
+  // a background thread, at most one compaction per shard at a time.
+  void Compact() {
     auto start_time = std::chrono::high_resolution_clock::now();
+    std::chrono::milliseconds duration;
+
+    // Freeze the delta, new writes go to a fresh one.
+    Serving* base;
+    Delta* frozen;
+    {
+      std::lock_guard<std::mutex> lock(write_mutex);
+      compaction_requested = false;
+      if (compacting) return;
+      View* v = view.load(std::memory_order_relaxed);
+      base = v->serving;
+      frozen = v->delta;
+      compacting = true;
+      replay_removes.clear();
+      Publish(base, frozen, new Delta(std::vector<Entry>()));
+    }
+
+    // Nothing but tombstones changes in base and frozen from now on, and
+    // tombstones set meanwhile are in replay_removes.
+    Serving* new_serving = BuildServing(*base, *frozen);
+
+    // Swap, replaying the removals that arrived during the rebuild.
+    {
+      std::lock_guard<std::mutex> lock(write_mutex);
+      for (Entry p : replay_removes) {
+        int position = ServingPosition(*new_serving, p, false);
+        if (position >= 0) {
+          new_serving->removed.Set(position);
+          ++new_serving->removed_count;
+        }
+      }
+      replay_removes.clear();
+      // The adds that arrived during the rebuild only set bits in the filter
+      // of the old serving area.
+      Delta* delta = view.load(std::memory_order_relaxed)->delta;
+      FilterDelta(new_serving, *delta);
+      Publish(new_serving, nullptr, delta);
+      compacting = false;
+      auto end_time = std::chrono::high_resolution_clock::now();
+      last_rebuild_time = end_time;
+      duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+      CountRebuild(duration.count());
+    }
+
+    std::cout << "Rebuilt shard. Took " << duration.count() << "ms." << std::endl;
+  }
+
+ private:
+  static constexpr int MAX_PENDING_SIZE = 256;
+  static constexpr int RADIX_BITS = 11;
+
+  static Entry MakeEntry(uint32_t fingerprint, int64_t record_index) {
+    return ((Entry) fingerprint << INDEX_BITS) | (Entry) record_index;
+  }
+
+  static uint32_t FingerprintOf(Entry entry) {
+    return (uint32_t) (entry >> INDEX_BITS);
+  }
+
+  static int64_t IndexOf(Entry entry) {
+    return (int64_t) (entry & MAX_INDEX);
+  }
+
+  // One bit per position, set and tested concurrently.
+  class Tombstones {
+   public:
+    explicit Tombstones(int size)
+        : bits(new std::atomic<uint64_t>[(size + 63) / 64]()) { }
 
-    int count = delta_add.size() + serving_size;
-    int its = serving_size - 1;
-    auto ita = delta_add.rbegin();
-    int itns = count - 1;
+    bool Test(int position) const {
+      return (bits[position / 64].load(std::memory_order_acquire) >> (position % 64)) & 1;
+    }
+
+    void Set(int position) {
+      bits[position / 64].fetch_or((uint64_t) 1 << (position % 64), std::memory_order_release);
+    }
+
+    void Clear(int position) {
+      bits[position / 64].fetch_and(~((uint64_t) 1 << (position % 64)), std::memory_order_release);
+    }
 
-    while (its >= 0 && ita != delta_add.rend()) {
-      if (ita->first >= serving_prefixes[its]) {
-        serving_prefixes[itns] = ita->first;
-        serving_rindexes[itns] = ita->second;
-        ++ita;
+   private:
+    std::unique_ptr<std::atomic<uint64_t>[]> bits;
+  };
+
+  // Sorted entries, plain or compressed, and their search index. Only the
+  // tombstones change once the serving area is published.
+  struct Serving {
+    explicit Serving(int size)
+        : size(size), entries(new AHVMmapArray<Entry>(size)), removed(size), removed_count(0) { }
+
+    Serving(std::unique_ptr<AHVMmapArray<Entry>> sorted_entries, int size)
+        : size(size), entries(std::move(sorted_entries)), removed(size), removed_count(0) { }
+
+    // Called once the entries are filled in: builds the filter and the search
+    // index, compressing the entries first if asked to.
+    void Seal(const AHVCache_RadixOptions& options) {
+      if (options.bloom_filter) {
+        // Room for the delta adds until the next rebuild.
+        filter.reset(new AHVBloomFilter(size + MAX_DELTA_SIZE));
+        for (int i = 0; i < size; ++i) {
+          filter->Add(FingerprintOf((*entries)[i]));
+        }
+      }
+      if (options.compressed_serving) {
+        compressed.reset(new AHVCompressedEntries(entries->get(), size, INDEX_BITS));
+        entries.reset();
+      }
+      if (compressed) {
+        index.Build(compressed->block_keys(), compressed->blocks());
       } else {
-        serving_prefixes[itns] = serving_prefixes[its];
-        serving_rindexes[itns] = serving_rindexes[its];
-        --its;
+        index.Build(entries->get(), size);
       }
-      --itns;
     }
-    serving_size = count;
-    delta_add.clear();
+
+    // The index searches the entries, or the first fingerprints of the
+    // compressed blocks (64 bit whatever the entries are).
+    uint64_t SearchKey(uint32_t fingerprint) const {
+      return compressed ? (uint64_t) fingerprint : (uint64_t) MakeEntry(fingerprint, 0);
+    }
+
+    // Index search for the entries with fingerprint, to pass to Scan.
+    size_t LowerBound(uint32_t fingerprint) const {
+      uint64_t key = SearchKey(fingerprint);
+      return compressed ? index.LowerBound(compressed->block_keys(), compressed->blocks(), key)
+                        : index.LowerBound(entries->get(), size, key);
+    }
+
+    // Completes a search started by index.Start, returns the same as
+    // LowerBound.
+    size_t Finish(AHVSearchIndex::Cursor* cursor) const {
+      return compressed ? index.Finish(compressed->block_keys(), compressed->blocks(), cursor)
+                        : index.Finish(entries->get(), size, cursor);
+    }
+
+    void PrefetchBlock(const AHVSearchIndex::Cursor& cursor) const {
+      if (compressed) {
+        index.PrefetchBlock(compressed->block_keys(), compressed->blocks(), cursor);
+      } else {
+        index.PrefetchBlock(entries->get(), size, cursor);
+      }
+    }
+
+    // Calls f(position, record index) for the entries with fingerprint,
+    // lower_bound is what the index search for it returned.
+    template <typename F>
+    void Scan(size_t lower_bound, uint32_t fingerprint, F f) const {
+      if (compressed) {
+        compressed->ScanFrom(lower_bound, fingerprint, f);
+        return;
+      }
+      for (size_t i = lower_bound; i < (size_t) size && FingerprintOf((*entries)[i]) == fingerprint; ++i) {
+        f(i, IndexOf((*entries)[i]));
+      }
+    }
+
+    // False if no entry of the shard, serving or delta, has fingerprint.
+    bool MayContain(uint32_t fingerprint) const {
+      return filter == nullptr || filter->MayContain(fingerprint);
+    }
+
+    int size;
+    std::unique_ptr<AHVMmapArray<Entry>> entries;  // Null once compressed.
+    std::unique_ptr<AHVCompressedEntries> compressed;
+    AHVSearchIndex index;
+    // Set by the adds to the deltas too, removals only leave it at the next
+    // rebuild. Null unless options.bloom_filter.
+    std::unique_ptr<AHVBloomFilter> filter;
+    Tombstones removed;
+    int removed_count;  // Writers only.
+  };
+
+  // Adds are sorted, except for the last few which are appended to the
+  // pending buffer and merged in batches. Tombstone positions index sorted
+  // first, then pending.
+  struct Delta {
+    explicit Delta(std::vector<Entry> sorted_entries)
+        : sorted(std::move(sorted_entries)), pending_count(0),
+          removed(sorted.size() + MAX_PENDING_SIZE) { }
+
+    std::vector<Entry> sorted;
+    Entry pending[MAX_PENDING_SIZE];
+    std::atomic<int> pending_count;
+    Tombstones removed;
+  };
+
+  // frozen is only set while a compaction is running.
+  struct View {
+    Serving* serving;
+    Delta* frozen;
+    Delta* delta;
+  };
+
+ public:
+  struct Probe {
+    const View* view;
+    uint32_t fingerprint;
+    bool filter_pending;  // The filter was prefetched but not tested yet.
+    bool ruled_out;  // The filter has no entry with fingerprint.
+    AHVSearchIndex::Cursor cursor;
+  };
+
+ private:
+  // Reads the entries of a serving area in order, a block at a time if they
+  // are compressed.
+  class ServingReader {
+   public:
+    explicit ServingReader(const Serving& serving)
+        : serving_(serving), position_(0) {
+      Load();
+    }
+
+    bool Done() const {
+      return position_ >= (size_t) serving_.size;
+    }
+
+    size_t position() const {
+      return position_;
+    }
+
+    Entry entry() const {
+      return serving_.compressed ? block_[position_ % AHVCompressedEntries::BLOCK_SIZE]
+                                 : (*serving_.entries)[position_];
+    }
+
+    void Next() {
+      ++position_;
+      if (position_ % AHVCompressedEntries::BLOCK_SIZE == 0) Load();
+    }
+
+   private:
+    void Load() {
+      if (serving_.compressed && !Done()) {
+        serving_.compressed->DecodeBlock(position_ / AHVCompressedEntries::BLOCK_SIZE, block_);
+      }
+    }
+
+    const Serving& serving_;
+    size_t position_;
+    Entry block_[AHVCompressedEntries::BLOCK_SIZE];
+  };
+
+  static void ServingFind(const Serving& serving, uint32_t fingerprint, AHVCandidates* candidates) {
+    ServingCollect(serving, serving.LowerBound(fingerprint), fingerprint, candidates);
+  }
+
+  // Adds the live entries with fingerprint, lower_bound is what the index
+  // search for it returned.
+  static void ServingCollect(const Serving& serving, size_t lower_bound, uint32_t fingerprint,
+                             AHVCandidates* candidates) {
+    serving.Scan(lower_bound, fingerprint, [&] (size_t position, int64_t record_index) -> void {
+      if (!serving.removed.Test(position)) {
+        candidates->Add(record_index);
+      }
+    });
+  }
+
+  static void DeltaFind(const Delta& delta, uint32_t fingerprint, AHVCandidates* candidates) {
+    auto begin = delta.sorted.begin();
+    auto it = std::lower_bound(begin, delta.sorted.end(), MakeEntry(fingerprint, 0));
+    for (; it != delta.sorted.end() && FingerprintOf(*it) == fingerprint; ++it) {
+      if (delta.removed.Test(it - begin)) continue;
+      candidates->Add(IndexOf(*it));
+    }
+    int sorted_size = delta.sorted.size();
+    int pending_count = delta.pending_count.load(std::memory_order_acquire);
+    for (int i = 0; i < pending_count; ++i) {
+      if (FingerprintOf(delta.pending[i]) != fingerprint) continue;
+      if (delta.removed.Test(sorted_size + i)) continue;
+      candidates->Add(IndexOf(delta.pending[i]));
+    }
+  }
+
+  // Tests the filter once its line was prefetched, returns false if the
+  // probe is ruled out.
+  static bool CheckFilter(Probe* probe) {
+    if (probe->filter_pending) {
+      probe->filter_pending = false;
+      probe->ruled_out = !probe->view->serving->MayContain(probe->fingerprint);
+    }
+    return !probe->ruled_out;
+  }
+
+  // Sets the filter bits of the live delta entries.
+  static void FilterDelta(Serving* serving, const Delta& delta) {
+    if (serving->filter == nullptr) return;
+    for (Entry p : DeltaEntries(delta)) {
+      serving->filter->Add(FingerprintOf(p));
+    }
+  }
+
+  // Returns the serving position of p, only considering entries whose
+  // tombstone is set to removed, or -1.
+  static int ServingPosition(const Serving& serving, Entry p, bool removed) {
+    uint32_t fingerprint = FingerprintOf(p);
+    int found = -1;
+    serving.Scan(serving.LowerBound(fingerprint), fingerprint, [&] (size_t position, int64_t record_index) -> void {
+      if (found < 0 && record_index == IndexOf(p) && serving.removed.Test(position) == removed) {
+        found = position;
+      }
+    });
+    return found;
+  }
+
+  // Returns the position of a live p in the delta, or -1.
+  static int DeltaPosition(const Delta& delta, Entry p) {
+    auto it = std::lower_bound(delta.sorted.begin(), delta.sorted.end(), p);
+    for (; it != delta.sorted.end() && *it == p; ++it) {
+      int position = it - delta.sorted.begin();
+      if (!delta.removed.Test(position)) return position;
+    }
+    int sorted_size = delta.sorted.size();
+    int pending_count = delta.pending_count.load(std::memory_order_relaxed);
+    for (int i = 0; i < pending_count; ++i) {
+      if (delta.pending[i] == p && !delta.removed.Test(sorted_size + i)) {
+        return sorted_size + i;
+      }
+    }
+    return -1;
+  }
+
+  // Live delta entries, sorted.
+  static std::vector<Entry> DeltaEntries(const Delta& delta) {
+    std::vector<Entry> entries;
+    entries.reserve(delta.sorted.size() + MAX_PENDING_SIZE);
+    for (size_t i = 0; i < delta.sorted.size(); ++i) {
+      if (delta.removed.Test(i)) continue;
+      entries.push_back(delta.sorted[i]);
+    }
+    size_t middle = entries.size();
+    int pending_count = delta.pending_count.load(std::memory_order_acquire);
+    for (int i = 0; i < pending_count; ++i) {
+      if (delta.removed.Test(delta.sorted.size() + i)) continue;
+      entries.push_back(delta.pending[i]);
+    }
+    std::sort(entries.begin() + middle, entries.end());
+    std::inplace_merge(entries.begin(), entries.begin() + middle, entries.end());
+    return entries;
+  }
+
+  // Builds a serving area out of the live entries of serving and delta in
+  // one sequential merge. Both are sorted and removals are tombstones, so
+  // nothing needs to be sorted or allocated per entry.
+  Serving* BuildServing(const Serving& serving, const Delta& delta) const {
+    return BuildServing(serving, DeltaEntries(delta));
+  }
+
+  Serving* BuildServing(const Serving& serving, const std::vector<Entry>& added) const {
+    Serving* new_serving = new Serving(LiveCount(serving) + added.size());
+    new_serving->size = MergeLive(serving, added, new_serving->entries->get());
+    new_serving->Seal(options);
+    return new_serving;
+  }
+
+  // Tombstones may still be set while a compaction merges (see Compact), this
+  // is only an upper bound of what the merge writes.
+  static int LiveCount(const Serving& serving) {
+    int live = serving.size;
+    for (int i = 0; i < serving.size; ++i) {
+      if (serving.removed.Test(i)) --live;
+    }
+    return live;
+  }
+
+  // Merges the live entries of serving with added (sorted) into out, returns
+  // how many were written.
+  static int MergeLive(const Serving& serving, const std::vector<Entry>& added, Entry* out) {
+    ServingReader reader(serving);
+    int itd = 0, itns = 0;
+    while (true) {
+      while (!reader.Done() && serving.removed.Test(reader.position())) reader.Next();
+      bool serving_left = !reader.Done();
+      bool delta_left = itd < (int) added.size();
+      if (!serving_left && !delta_left) break;
+      if (!delta_left || (serving_left && reader.entry() <= added[itd])) {
+        out[itns] = reader.entry();
+        reader.Next();
+      } else {
+        out[itns] = added[itd++];
+      }
+      ++itns;
+    }
+    return itns;
+  }
+
+  // Stable LSD radix sort of size entries on their fingerprint, RADIX_BITS
+  // per pass, through buffer. Returns whichever of the two holds the result.
+  static Entry* SortByFingerprint(Entry* entries, Entry* buffer, size_t size) {
+    const Entry digit_mask = ((Entry) 1 << RADIX_BITS) - 1;
+    std::vector<size_t> starts(1 << RADIX_BITS);
+    for (int shift = INDEX_BITS; shift < INDEX_BITS + FINGERPRINT_BITS; shift += RADIX_BITS) {
+      std::fill(starts.begin(), starts.end(), 0);
+      for (size_t i = 0; i < size; ++i) {
+        ++starts[(entries[i] >> shift) & digit_mask];
+      }
+      size_t start = 0;
+      for (size_t& count : starts) {
+        size_t digit_count = count;
+        count = start;
+        start += digit_count;
+      }
+      for (size_t i = 0; i < size; ++i) {
+        buffer[starts[(entries[i] >> shift) & digit_mask]++] = entries[i];
+      }
+      std::swap(entries, buffer);
+    }
+    return entries;
+  }
+
+  // Replaces the current view, retiring the old view and whichever of its
+  // parts are not part of the new one.
+  void Publish(Serving* serving, Delta* frozen, Delta* delta) {
+    View* old_view = view.load(std::memory_order_relaxed);
+    // Sequentially consistent, like the epoch announcements: a reader
+    // that entered its guard after Reclaim scanned the slots sees this store.
+    view.store(new View{serving, frozen, delta});
+    AHVEpoch& epoch = AHVEpoch::Global();
+    if (old_view->serving != serving) epoch.Retire(old_view->serving);
+    if (old_view->frozen != nullptr && old_view->frozen != frozen) epoch.Retire(old_view->frozen);
+    if (old_view->delta != delta && old_view->delta != frozen) epoch.Retire(old_view->delta);
+    epoch.Retire(old_view);
+    epoch.Reclaim();
+    UpdateSizes();
+  }
+
+  // Refreshes the sizes GetStats reports, after each change of the view or
+  // of its sizes. Under write_mutex.
+  void UpdateSizes() {
+    View* v = view.load(std::memory_order_relaxed);
+    serving_size.store(v->serving->size, std::memory_order_relaxed);
+    delta_size.store(v->delta->sorted.size() + v->delta->pending_count.load(std::memory_order_relaxed) +
+                     v->serving->removed_count, std::memory_order_relaxed);
+  }
+
+  // Sorts the pending adds into a new delta, dropping removed entries.
+  void FlushPending() {
+    View* v = view.load(std::memory_order_relaxed);
+    Publish(v->serving, v->frozen, new Delta(DeltaEntries(*v->delta)));
+  }
+
+  // Merges the delta into the serving area in the foreground, for bulk
+  // loading.
+  void Rebuild() {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    View* v = view.load(std::memory_order_relaxed);
+    Publish(BuildServing(*v->serving, *v->delta), nullptr, new Delta(std::vector<Entry>()));
 
     auto end_time = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
     std::cout << "Rebuilt shard. Took " << duration.count() << "ms." << std::endl;
     last_rebuild_time = std::chrono::high_resolution_clock::now();
+    CountRebuild(duration.count());
   }
 
- private:
-  const int MAX_DELTA_SIZE = 20 * 4096; // total 20M
-  const int MAX_DELTA_SIZE_WITH_TIME = 4096; // total 1M
-  const int MAX_SERVING_SIZE = 4194304; // total 1G
+  // Under write_mutex.
+  void CountRebuild(int64_t ms) {
+    ++rebuilds;
+    rebuild_ms += ms;
+    ++rebuild_histogram[AHVCacheShardStats::DurationBucket(ms)];
+  }
+
+  // Memory held by a serving area, its index, filter and tombstones.
+  static int64_t ServingBytes(const Serving& serving) {
+    int64_t bytes = serving.compressed ? serving.compressed->bytes() : (int64_t) serving.size * sizeof(Entry);
+    bytes += serving.index.bytes() + (serving.size + 63) / 64 * sizeof(uint64_t);
+    if (serving.filter != nullptr) {
+      bytes += serving.filter->bytes();
+    }
+    return bytes;
+  }
+
+  static int64_t DeltaBytes(const Delta& delta) {
+    return sizeof(Delta) + delta.sorted.capacity() * sizeof(Entry) +
+           (delta.sorted.size() + MAX_PENDING_SIZE + 63) / 64 * sizeof(uint64_t);
+  }
+
+  AHVCache_RadixOptions options;
+
+  std::atomic<View*> view;
+  std::mutex write_mutex;
+
+  // Set once MaybeRebuild asked for a compaction, so that it asks only once.
+  bool compaction_requested;
+  // Set while Compact runs. Removals hitting the frozen serving area or delta
+  // are recorded in replay_removes. Written under write_mutex, read by
+  // GetStats without it.
+  std::atomic<bool> compacting;
+  std::vector<Entry> replay_removes;
 
-  int32_t* serving_prefixes;
-  int32_t* serving_rindexes;
-  int32_t serving_size;
+  // Entries bulk loaded until FinishLoad, per part.
+  std::vector<std::vector<Entry>> load_parts;
 
-  std::set<std::pair<int32_t, int32_t>> delta_add;
-  std::set<std::pair<int32_t, int32_t>> delta_remove;
+  // Written under write_mutex, read by GetStats without it.
+  std::atomic<std::chrono::time_point<std::chrono::high_resolution_clock>> last_rebuild_time;
+  std::atomic<int64_t> serving_size{0};
+  // Adds and removals not compacted yet, the frozen delta excluded.
+  std::atomic<int64_t> delta_size{0};
 
-  std::chrono::time_point<std::chrono::high_resolution_clock> last_rebuild_time;
+  // Rebuilds so far, under write_mutex.
+  int64_t rebuilds = 0;
+  int64_t rebuild_ms = 0;
+  int64_t rebuild_histogram[AHVCacheShardStats::DURATION_BUCKETS] = {};
 };
 
-#endif  // AHV_DEFENDER_AHV_CACHE_RADIX_BUCKET_H_
\ No newline at end of file
+#endif  // AHV_DEFENDER_AHV_CACHE_RADIX_BUCKET_H_
@@ -0,0 +1,14 @@
+#ifndef AHV_DEFENDER_AHV_CACHE_RADIX_OPTIONS_H_
+#define AHV_DEFENDER_AHV_CACHE_RADIX_OPTIONS_H_
+
+struct AHVCache_RadixOptions {
+  // Keep the serving areas compressed (see AHVCompressedEntries): about a
+  // third less memory, lookups decode a block of entries.
+  bool compressed_serving = false;
+  // Keep a blocked Bloom filter per shard (see AHVBloomFilter), so that most
+  // lookups of absent hashes read one cache line instead of searching the
+  // serving area and the deltas. About 2 bytes per entry.
+  bool bloom_filter = false;
+};
+
+#endif  // AHV_DEFENDER_AHV_CACHE_RADIX_OPTIONS_H_
@@ -0,0 +1,45 @@
+#ifndef AHV_DEFENDER_AHV_CANDIDATES_H_
+#define AHV_DEFENDER_AHV_CANDIDATES_H_
+
+#include <cstdint>
+#include <vector>
+
+// Record indexes that possibly hold a hash, as returned by a cache lookup.
+// Caches return very few candidates (almost always 0 or 1), so they are kept
+// in a small inline buffer and a lookup does not allocate. Only pathological
+// prefix collisions spill over to the heap.
+class AHVCandidates {
+ public:
+  AHVCandidates() : count_(0) { }
+
+  void Clear() {
+    count_ = 0;
+    overflow_.clear();
+  }
+
+  void Add(int64_t record_index) {
+    if (count_ < INLINE_SIZE) {
+      inline_[count_] = record_index;
+    } else {
+      overflow_.push_back(record_index);
+    }
+    ++count_;
+  }
+
+  int size() const {
+    return count_;
+  }
+
+  int64_t operator[](int i) const {
+    return i < INLINE_SIZE ? inline_[i] : overflow_[i - INLINE_SIZE];
+  }
+
+ private:
+  static const int INLINE_SIZE = 8;
+
+  int64_t inline_[INLINE_SIZE];
+  int count_;
+  std::vector<int64_t> overflow_;
+};
+
+#endif  // AHV_DEFENDER_AHV_CANDIDATES_H_
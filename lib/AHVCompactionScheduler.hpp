@@ -0,0 +1,135 @@
+#ifndef AHV_DEFENDER_AHV_COMPACTION_SCHEDULER_H_
+#define AHV_DEFENDER_AHV_COMPACTION_SCHEDULER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Decides which radix shards get compacted and when. Writers only report
+// shards whose deltas outgrew their limit (Request), the age based triggers
+// are evaluated here once per tick rather than on every request.
+//
+// At most max_workers compactions run at a time and together they allocate
+// at most memory_budget bytes, so that a burst of writes (or the end of a
+// bulk load) does not rebuild many shards at once and hurt lookup latency.
+// The largest deltas are compacted first. A compaction larger than the whole
+// budget still runs, alone.
+//
+// Bucket is an AHVCache_RadixBucket instantiation.
+template <typename Bucket>
+class AHVCompactionScheduler {
+ public:
+  AHVCompactionScheduler(Bucket* buckets, int bucket_count,
+                         int max_workers = DefaultMaxWorkers(),
+                         int64_t memory_budget = DEFAULT_MEMORY_BUDGET)
+      : buckets_(buckets), requested_(bucket_count, false), running_(bucket_count, false),
+        memory_budget_(memory_budget), memory_in_use_(0), running_count_(0), stopping_(false) {
+    for (int i = 0; i < max_workers; ++i) {
+      workers_.emplace_back(&AHVCompactionScheduler::WorkerLoop, this);
+    }
+  }
+
+  ~AHVCompactionScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Asks for the bucket to be compacted as soon as the budgets allow it.
+  void Request(int bucket) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      requested_[bucket] = true;
+    }
+    cv_.notify_one();
+  }
+
+ private:
+  static constexpr int64_t DEFAULT_MEMORY_BUDGET = (int64_t) 1 << 30;
+  static constexpr int TICK_MS = 1000;
+  // Shards whose deltas stayed small are compacted once they are this old
+  // and no longer tiny (relative to the delta limit, shards can be small).
+  static constexpr int MAX_AGE_SECONDS = 10 * 60;
+  static constexpr int MIN_AGED_DELTA_SIZE = std::min(4096, Bucket::MAX_DELTA_SIZE / 20);
+
+  static int DefaultMaxWorkers() {
+    return std::max(1, (int) std::thread::hardware_concurrency() / 8);
+  }
+
+  void WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      int bucket;
+      int64_t memory;
+      if (!PickBucket(&bucket, &memory)) {
+        cv_.wait_for(lock, std::chrono::milliseconds(TICK_MS));
+        continue;
+      }
+      requested_[bucket] = false;
+      running_[bucket] = true;
+      memory_in_use_ += memory;
+      ++running_count_;
+      lock.unlock();
+      buckets_[bucket].Compact();
+      lock.lock();
+      running_[bucket] = false;
+      memory_in_use_ -= memory;
+      --running_count_;
+      // Budget was released, another worker might fit its pick now.
+      cv_.notify_all();
+    }
+  }
+
+  // Picks the requested or aged shard with the largest delta. Returns false
+  // if there is none, or if it does not fit the memory budget next to the
+  // compactions already running. The shard stats take no lock (see
+  // AHVCache_RadixBucket::GetStats), scanning them all is a few loads each.
+  bool PickBucket(int* bucket, int64_t* memory) {
+    auto now = std::chrono::high_resolution_clock::now();
+    int best = -1;
+    typename Bucket::Stats best_stats = typename Bucket::Stats();
+    for (int i = 0; i < (int) requested_.size(); ++i) {
+      if (running_[i]) continue;
+      typename Bucket::Stats stats = buckets_[i].GetStats();
+      if (stats.compacting) continue;
+      if (!requested_[i]) {
+        auto age = std::chrono::duration_cast<std::chrono::seconds>(now - stats.last_rebuild_time);
+        if (age.count() <= MAX_AGE_SECONDS || stats.delta_size <= MIN_AGED_DELTA_SIZE) continue;
+      }
+      if (best < 0 || stats.delta_size > best_stats.delta_size) {
+        best = i;
+        best_stats = stats;
+      }
+    }
+    if (best < 0) return false;
+    if (running_count_ > 0 && memory_in_use_ + best_stats.compaction_memory > memory_budget_) {
+      return false;
+    }
+    *bucket = best;
+    *memory = best_stats.compaction_memory;
+    return true;
+  }
+
+  Bucket* buckets_;
+  std::vector<bool> requested_;
+  std::vector<bool> running_;
+  int64_t memory_budget_;
+  int64_t memory_in_use_;
+  int running_count_;
+  bool stopping_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<std::thread> workers_;
+};
+
+#endif  // AHV_DEFENDER_AHV_COMPACTION_SCHEDULER_H_
@@ -0,0 +1,169 @@
+#ifndef AHV_DEFENDER_AHV_COMPRESSED_ENTRIES_H_
+#define AHV_DEFENDER_AHV_COMPRESSED_ENTRIES_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include "AHVMmapArray.hpp"
+
+// Sorted radix entries (fingerprint << index_bits | index, 32 or 64 bit)
+// compressed in blocks of BLOCK_SIZE entries. The fingerprints of a shard are close to
+// uniform, so the gaps between consecutive ones are small:
+//   * directory: the first fingerprint of every block (searched like plain
+//     entries are) and the offset and bit width of its gaps.
+//   * gaps: per block, the BLOCK_SIZE - 1 fingerprint gaps packed at the
+//     width of the largest one (frame of reference).
+//   * indexes: one per entry, packed at the width of the largest index.
+// At 4M entries per shard the gaps take about 10 bits and the entries about
+// 5.5 bytes with the directory, instead of 8. A lookup reads a directory
+// entry, the gaps of one or two blocks (a cache line each) and the index of
+// each match.
+class AHVCompressedEntries {
+ public:
+  static const int BLOCK_SIZE = 32;
+
+  template <typename Entry>
+  AHVCompressedEntries(const Entry* entries, size_t size, int index_bits)
+      : size_(size), index_bits_(index_bits), blocks_((size + BLOCK_SIZE - 1) / BLOCK_SIZE),
+        block_keys_(blocks_), block_meta_(blocks_) {
+    uint64_t index_mask = ((uint64_t) 1 << index_bits) - 1;
+    uint64_t max_index = 0;
+    size_t gap_bits = 0;
+    for (size_t b = 0; b < blocks_; ++b) {
+      size_t begin = b * BLOCK_SIZE;
+      size_t end = std::min(size, begin + BLOCK_SIZE);
+      uint64_t max_gap = 0;
+      for (size_t i = begin + 1; i < end; ++i) {
+        max_gap = std::max(max_gap, (uint64_t) ((entries[i] >> index_bits) - (entries[i - 1] >> index_bits)));
+      }
+      int width = BitWidth(max_gap);
+      block_keys_[b] = entries[begin] >> index_bits;
+      block_meta_[b] = ((uint64_t) width << 56) | gap_bits;
+      gap_bits += (end - begin - 1) * width;
+      for (size_t i = begin; i < end; ++i) {
+        max_index = std::max(max_index, entries[i] & index_mask);
+      }
+    }
+    packed_index_bits_ = BitWidth(max_index);
+
+    // Room for the 8 byte loads of the last fields.
+    gaps_.reset(new AHVMmapArray<unsigned char>((gap_bits + 7) / 8 + 8));
+    indexes_.reset(new AHVMmapArray<unsigned char>((size * packed_index_bits_ + 7) / 8 + 8));
+    for (size_t b = 0; b < blocks_; ++b) {
+      size_t begin = b * BLOCK_SIZE;
+      size_t end = std::min(size, begin + BLOCK_SIZE);
+      int width = block_meta_[b] >> 56;
+      size_t offset = block_meta_[b] & OFFSET_MASK;
+      for (size_t i = begin + 1; i < end; ++i) {
+        Write(gaps_->get(), offset, width, (entries[i] >> index_bits) - (entries[i - 1] >> index_bits));
+        offset += width;
+      }
+      for (size_t i = begin; i < end; ++i) {
+        Write(indexes_->get(), i * packed_index_bits_, packed_index_bits_, entries[i] & index_mask);
+      }
+    }
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  size_t blocks() const {
+    return blocks_;
+  }
+
+  // First fingerprint of every block, sorted.
+  const uint64_t* block_keys() const {
+    return block_keys_.get();
+  }
+
+  size_t bytes() const {
+    return blocks_ * 2 * sizeof(uint64_t) + gaps_->size() + indexes_->size();
+  }
+
+  // Decodes the entries of block into out, returns how many there are.
+  template <typename Entry>
+  int DecodeBlock(size_t block, Entry* out) const {
+    size_t begin = block * BLOCK_SIZE;
+    int count = (int) (std::min(size_, begin + BLOCK_SIZE) - begin);
+    int width = block_meta_[block] >> 56;
+    size_t offset = block_meta_[block] & OFFSET_MASK;
+    uint64_t fingerprint = block_keys_[block];
+    for (int i = 0; i < count; ++i) {
+      if (i > 0) {
+        fingerprint += Read(gaps_->get(), offset, width);
+        offset += width;
+      }
+      out[i] = (Entry) ((fingerprint << index_bits_) | IndexAt(begin + i));
+    }
+    return count;
+  }
+
+  // Calls f(position, index) for each entry with fingerprint, in order.
+  // block is the first block whose first fingerprint is not less than
+  // fingerprint, the entries might start in the block before it.
+  template <typename F>
+  void ScanFrom(size_t block, uint64_t fingerprint, F f) const {
+    for (size_t b = block > 0 ? block - 1 : 0; b < blocks_; ++b) {
+      size_t begin = b * BLOCK_SIZE;
+      int count = (int) (std::min(size_, begin + BLOCK_SIZE) - begin);
+      int width = block_meta_[b] >> 56;
+      size_t offset = block_meta_[b] & OFFSET_MASK;
+      uint64_t current = block_keys_[b];
+      for (int i = 0; i < count; ++i) {
+        if (i > 0) {
+          current += Read(gaps_->get(), offset, width);
+          offset += width;
+        }
+        if (current > fingerprint) return;
+        if (current == fingerprint) {
+          f(begin + i, (int64_t) IndexAt(begin + i));
+        }
+      }
+    }
+  }
+
+ private:
+  static const uint64_t OFFSET_MASK = ((uint64_t) 1 << 56) - 1;
+
+  static int BitWidth(uint64_t value) {
+    return value == 0 ? 0 : 64 - __builtin_clzll(value);
+  }
+
+  // Fields are at most 56 bits wide, so that one unaligned 8 byte load
+  // covers them wherever they start.
+  static uint64_t Read(const unsigned char* data, size_t bit_offset, int width) {
+    if (width == 0) return 0;
+    uint64_t word;
+    memcpy(&word, data + bit_offset / 8, 8);
+    return (word >> (bit_offset % 8)) & (((uint64_t) 1 << width) - 1);
+  }
+
+  static void Write(unsigned char* data, size_t bit_offset, int width, uint64_t value) {
+    if (width == 0) return;
+    uint64_t word;
+    memcpy(&word, data + bit_offset / 8, 8);
+    word |= value << (bit_offset % 8);
+    memcpy(data + bit_offset / 8, &word, 8);
+  }
+
+  uint64_t IndexAt(size_t position) const {
+    return Read(indexes_->get(), position * packed_index_bits_, packed_index_bits_);
+  }
+
+  size_t size_;
+  int index_bits_;
+  int packed_index_bits_;
+  size_t blocks_;
+  AHVMmapArray<uint64_t> block_keys_;
+  // Width of the block gaps in the top 8 bits, bit offset of the first one
+  // in the other 56.
+  AHVMmapArray<uint64_t> block_meta_;
+  std::unique_ptr<AHVMmapArray<unsigned char>> gaps_;
+  std::unique_ptr<AHVMmapArray<unsigned char>> indexes_;
+};
+
+#endif  // AHV_DEFENDER_AHV_COMPRESSED_ENTRIES_H_
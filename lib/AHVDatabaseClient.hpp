@@ -5,6 +5,7 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "ahvdefender.grpc.pb.h"
 
@@ -15,10 +16,14 @@ using grpc::Status;
 using ahvdefender::AHVDatabase;
 using ahvdefender::AHVLookupRequest;
 using ahvdefender::AHVLookupResponse;
+using ahvdefender::AHVLookupBatchRequest;
+using ahvdefender::AHVLookupBatchResponse;
 using ahvdefender::AHVAddRequest;
 using ahvdefender::AHVAddResponse;
 using ahvdefender::AHVRemoveRequest;
 using ahvdefender::AHVRemoveResponse;
+using ahvdefender::AHVStatsRequest;
+using ahvdefender::AHVStatsResponse;
 
 class AHVDatabaseClient {
  public:
@@ -35,6 +40,21 @@ class AHVDatabaseClient {
     return response.found();
   }
 
+  std::vector<bool> LookupBatch(const std::vector<std::string>& ahvs) {
+    AHVLookupBatchRequest request;
+    for (const std::string& ahv : ahvs) {
+      request.add_ahv(ahv);
+    }
+    AHVLookupBatchResponse response;
+    ClientContext context;
+    Status status = stub_->LookupBatch(&context, request, &response);
+    if (!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message() << std::endl;
+      exit(1);
+    }
+    return std::vector<bool>(response.found().begin(), response.found().end());
+  }
+
   bool Add(const std::string& ahv) {
     AHVAddRequest request;
     request.set_ahv(ahv);
@@ -61,6 +81,18 @@ class AHVDatabaseClient {
     return response.removed();
   }
 
+  AHVStatsResponse Stats() {
+    AHVStatsRequest request;
+    AHVStatsResponse response;
+    ClientContext context;
+    Status status = stub_->Stats(&context, request, &response);
+    if (!status.ok()) {
+      std::cerr << status.error_code() << ": " << status.error_message() << std::endl;
+      exit(1);
+    }
+    return response;
+  }
+
   static std::unique_ptr<AHVDatabaseClient> New(const std::string& target) {
     auto insecure_credentials = grpc::InsecureChannelCredentials();
     auto grpc_channel = grpc::CreateChannel(target, insecure_credentials);
@@ -0,0 +1,186 @@
+#ifndef AHV_DEFENDER_AHV_DATABASE_CORE_SERVICE_H_
+#define AHV_DEFENDER_AHV_DATABASE_CORE_SERVICE_H_
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "ahvdefender.grpc.pb.h"
+
+#include "AHVDatabaseServiceImpl.hpp"
+#include "AHVDiskDatabase.hpp"
+
+// Thread per core serving of the AHVDatabase service: a thread pinned to each
+// core the process may run on, each with its own completion queue and its own
+// calls waiting for requests. A request is received, hashed, looked up,
+// verified and answered on one core, the threads share no queue or pool.
+//
+// Lookups are not handed over to a core owning the shard: cache reads take no
+// lock and write nothing shared, the epoch slots (see AHVEpoch) and the lookup
+// counters (see AHVPerThread) are per thread. A hand-over would only add the
+// cross core traffic it is meant to save. Requests are not logged, unlike in
+// AHVDatabaseServiceImpl, the console lock would serialize the cores.
+class AHVDatabaseCoreService {
+ public:
+  explicit AHVDatabaseCoreService(AHVDiskDatabase* database)
+      : database_(database), cpus_(AllowedCpus()) { }
+
+  // Registers the service and a completion queue per core, before the server
+  // is built.
+  void Register(grpc::ServerBuilder* builder) {
+    builder->RegisterService(&service_);
+    for (size_t core = 0; core < cpus_.size(); ++core) {
+      queues_.push_back(builder->AddCompletionQueue());
+    }
+  }
+
+  // Starts the core threads, once the server is started.
+  void Start() {
+    for (size_t core = 0; core < cpus_.size(); ++core) {
+      threads_.emplace_back([this, core] () -> void { Run(core); });
+    }
+    std::cout << "Serving on " << cpus_.size() << " cores." << std::endl;
+  }
+
+  // Once the server is shut down: drains the queues and joins the threads.
+  void Stop() {
+    for (auto& queue : queues_) {
+      queue->Shutdown();
+    }
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+ private:
+  typedef ahvdefender::AHVDatabase::AsyncService AsyncService;
+
+  // An RPC in progress, the tag of its completion queue events.
+  class Call {
+   public:
+    virtual ~Call() = default;
+
+    // Handles the next event of the call, ok as returned by the queue.
+    virtual void Proceed(bool ok) = 0;
+  };
+
+  template <typename Request, typename Response>
+  class UnaryCall : public Call {
+   public:
+    typedef void (AsyncService::*RequestMethod)(grpc::ServerContext*, Request*,
+                                                grpc::ServerAsyncResponseWriter<Response>*,
+                                                grpc::CompletionQueue*, grpc::ServerCompletionQueue*, void*);
+    typedef std::function<void(const Request&, Response*)> Handler;
+
+    // Waits for the next request of the method on queue.
+    UnaryCall(AsyncService* service, grpc::ServerCompletionQueue* queue, RequestMethod request_method,
+              const Handler& handler)
+        : service_(service), queue_(queue), request_method_(request_method), handler_(handler),
+          responder_(&context_), answered_(false) {
+      (service_->*request_method_)(&context_, &request_, &responder_, queue_, queue_, this);
+    }
+
+    void Proceed(bool ok) override {
+      // Answered, or no request is coming because the server shut down.
+      if (answered_ || !ok) {
+        delete this;
+        return;
+      }
+      // Wait for the next request of the method while handling this one.
+      new UnaryCall(service_, queue_, request_method_, handler_);
+      handler_(request_, &response_);
+      answered_ = true;
+      responder_.Finish(response_, grpc::Status::OK, this);
+    }
+
+   private:
+    AsyncService* service_;
+    grpc::ServerCompletionQueue* queue_;
+    RequestMethod request_method_;
+    Handler handler_;
+    grpc::ServerContext context_;
+    Request request_;
+    Response response_;
+    grpc::ServerAsyncResponseWriter<Response> responder_;
+    bool answered_;
+  };
+
+  void Run(int core) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpus_[core], &cpu_set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+
+    grpc::ServerCompletionQueue* queue = queues_[core].get();
+    new UnaryCall<AHVLookupRequest, AHVLookupResponse>(
+        &service_, queue, &AsyncService::RequestLookup,
+        [this] (const AHVLookupRequest& request, AHVLookupResponse* response) -> void {
+          response->set_found(database_->Lookup(request.ahv()));
+        });
+    new UnaryCall<AHVLookupBatchRequest, AHVLookupBatchResponse>(
+        &service_, queue, &AsyncService::RequestLookupBatch,
+        [this] (const AHVLookupBatchRequest& request, AHVLookupBatchResponse* response) -> void {
+          std::vector<std::string> ahvs(request.ahv().begin(), request.ahv().end());
+          for (bool found : database_->LookupBatch(ahvs)) {
+            response->add_found(found);
+          }
+        });
+    new UnaryCall<AHVAddRequest, AHVAddResponse>(
+        &service_, queue, &AsyncService::RequestAdd,
+        [this] (const AHVAddRequest& request, AHVAddResponse* response) -> void {
+          response->set_added(database_->Add(request.ahv()));
+        });
+    new UnaryCall<AHVRemoveRequest, AHVRemoveResponse>(
+        &service_, queue, &AsyncService::RequestRemove,
+        [this] (const AHVRemoveRequest& request, AHVRemoveResponse* response) -> void {
+          response->set_removed(database_->Remove(request.ahv()));
+        });
+    new UnaryCall<AHVStatsRequest, AHVStatsResponse>(
+        &service_, queue, &AsyncService::RequestStats,
+        [this] (const AHVStatsRequest& request, AHVStatsResponse* response) -> void {
+          AHVDatabaseServiceImpl::FillStats(database_->CacheStats(), response);
+        });
+
+    void* tag;
+    bool ok;
+    while (queue->Next(&tag, &ok)) {
+      static_cast<Call*>(tag)->Proceed(ok);
+    }
+  }
+
+  // The cores the process may run on (e.g. restricted by taskset or a
+  // container), all of them if that cannot be told.
+  static std::vector<int> AllowedCpus() {
+    std::vector<int> cpus;
+    cpu_set_t cpu_set;
+    if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &cpu_set)) {
+          cpus.push_back(cpu);
+        }
+      }
+    }
+    if (cpus.empty()) {
+      for (int cpu = 0; cpu < std::max(1, (int) std::thread::hardware_concurrency()); ++cpu) {
+        cpus.push_back(cpu);
+      }
+    }
+    return cpus;
+  }
+
+  AHVDiskDatabase* database_;
+  std::vector<int> cpus_;
+  AsyncService service_;
+  std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> queues_;
+  std::vector<std::thread> threads_;
+};
+
+#endif  // AHV_DEFENDER_AHV_DATABASE_CORE_SERVICE_H_
@@ -4,6 +4,8 @@
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <vector>
 
 #include "ahvdefender.grpc.pb.h"
 
@@ -15,10 +17,14 @@ using grpc::Status;
 using ahvdefender::AHVDatabase;
 using ahvdefender::AHVLookupRequest;
 using ahvdefender::AHVLookupResponse;
+using ahvdefender::AHVLookupBatchRequest;
+using ahvdefender::AHVLookupBatchResponse;
 using ahvdefender::AHVAddRequest;
 using ahvdefender::AHVAddResponse;
 using ahvdefender::AHVRemoveRequest;
 using ahvdefender::AHVRemoveResponse;
+using ahvdefender::AHVStatsRequest;
+using ahvdefender::AHVStatsResponse;
 
 class AHVDatabaseServiceImpl final : public AHVDatabase::Service {
  public:
@@ -34,6 +40,18 @@ class AHVDatabaseServiceImpl final : public AHVDatabase::Service {
     return Status::OK;
   }
 
+  Status LookupBatch(ServerContext* context, const AHVLookupBatchRequest* request,
+                     AHVLookupBatchResponse* response) override {
+    cout_mutex.lock();
+    std::cout << "LookupBatch " << request->ahv_size() << " AHVs" << std::endl;
+    cout_mutex.unlock();
+    std::vector<std::string> ahvs(request->ahv().begin(), request->ahv().end());
+    for (bool found : ahv_disk_database_->LookupBatch(ahvs)) {
+      response->add_found(found);
+    }
+    return Status::OK;
+  }
+
   Status Add(ServerContext* context, const AHVAddRequest* request, AHVAddResponse* response) override {
     cout_mutex.lock();
     std::cout << "Add " << request->ahv() << std::endl;
@@ -50,7 +68,43 @@ class AHVDatabaseServiceImpl final : public AHVDatabase::Service {
     return Status::OK;
   }
 
+  Status Stats(ServerContext* context, const AHVStatsRequest* request, AHVStatsResponse* response) override {
+    cout_mutex.lock();
+    std::cout << "Stats" << std::endl;
+    cout_mutex.unlock();
+    FillStats(ahv_disk_database_->CacheStats(), response);
+    return Status::OK;
+  }
+
+  static void FillStats(const std::vector<AHVCacheShardStats>& shards, AHVStatsResponse* response) {
+    AHVCacheShardStats total;
+    for (const AHVCacheShardStats& shard : shards) {
+      total.Merge(shard);
+      FillShardStats(shard, response->add_shards());
+    }
+    FillShardStats(total, response->mutable_total());
+  }
+
  private:
+  static void FillShardStats(const AHVCacheShardStats& stats, ahvdefender::AHVCacheShardStats* message) {
+    message->set_finds(stats.finds);
+    message->set_candidates(stats.candidates);
+    message->set_rejected(stats.rejected);
+    message->set_serving_size(stats.serving_size);
+    message->set_delta_add_size(stats.delta_add_size);
+    message->set_delta_remove_size(stats.delta_remove_size);
+    message->set_bytes(stats.bytes);
+    message->set_rebuilds(stats.rebuilds);
+    message->set_rebuild_ms(stats.rebuild_ms);
+    for (int64_t count : stats.candidate_histogram) {
+      message->add_candidate_histogram(count);
+    }
+    for (int64_t count : stats.rebuild_histogram) {
+      message->add_rebuild_histogram(count);
+    }
+  }
+
+
   std::mutex cout_mutex;
   std::unique_ptr<AHVDiskDatabase> ahv_disk_database_;
 };
@@ -1,95 +1,272 @@
 #ifndef AHV_DEFENDER_AHV_DISK_DATABASE_H_
 #define AHV_DEFENDER_AHV_DISK_DATABASE_H_
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "AHVCache_Base.hpp"
 #include "AHVCache_Radix.hpp"
+#include "AHVCandidates.hpp"
+#include "AHVFingerprintTable.hpp"
+#include "AHVHash.hpp"
+#include "AHVJournal.hpp"
+#include "AHVSnapshot.hpp"
+#include "AHVStore_Base.hpp"
 #include "AHVStore_File.hpp"
+#include "AHVStore_Mmap.hpp"
 #include "BCryptHasher.hpp"
 
+// How lookups verify the cache candidates:
+//   * DISK: read the candidate records from the store, exact.
+//   * MEMORY: compare 64 bit fingerprints kept in RAM (see
+//     AHVFingerprintTable), 8 bytes per record. An unknown AHV is reported
+//     found with probability (candidates per lookup) / 2^64, for the radix
+//     cache at most records / 2^102. Only Add and Remove read the store.
+enum class AHVVerification {
+  DISK,
+  MEMORY,
+};
+
+// How the store file is read:
+//   * FILE: pread per record (see AHVStore_File).
+//   * MMAP: through a mapping of the file (see AHVStore_Mmap), for stores
+//     that fit the page cache.
+enum class AHVStoreType {
+  FILE,
+  MMAP,
+};
+
 class AHVDiskDatabase {
  public:
-  AHVDiskDatabase(const std::string& filename)
-      : store_(filename) { }
+  AHVDiskDatabase(const std::string& filename,
+                  std::unique_ptr<AHVCache_Base> cache = std::make_unique<AHVCache_Radix<>>(),
+                  AHVVerification verification = AHVVerification::DISK,
+                  AHVStoreType store_type = AHVStoreType::FILE)
+      : cache_(std::move(cache)), store_(NewStore(filename, store_type)),
+        snapshot_filename_(filename + ".snapshot"), journal_filename_(filename + ".journal") {
+    if (verification == AHVVerification::MEMORY) {
+      fingerprints_.reset(new AHVFingerprintTable());
+    }
+  }
 
+  // Loads the cache from the last snapshot if there is a usable one, then
+  // from the store records past it, bulk loaded by one thread per core.
   void Init() {
-    int64_t total_hashes = 0, total_free = 0;
     auto start = std::chrono::high_resolution_clock::now();
-    store_.ForEach(
-        [&] (const char* data, int64_t index) -> void {
-          cache_.Add(std::string(data + 1, 31), index, true);
-          ++total_hashes;
+    int64_t first_record = ReadSnapshot();
+    if (first_record == 0) {
+      cache_->Reserve(store_->RecordCount());
+    }
+    int parts = std::max(1, (int) std::thread::hardware_concurrency());
+    std::vector<PartCount> counts(parts);
+    cache_->StartLoad(parts);
+    store_->ParallelForEach(
+        parts,
+        [&] (const AHVHash& hash, int64_t index, int part) -> void {
+          if (fingerprints_ != nullptr) {
+            fingerprints_->Set(index, hash);
+          }
+          cache_->LoadPart(part, hash, index);
+          ++counts[part].hashes;
+        },
+        [&] (int64_t index, int part) -> void {
+          ++counts[part].free;
         },
-        [&] (int64_t index) -> void {
-          ++total_free;
-        });
+        first_record);
+    cache_->FinishLoad();
+    int64_t total_hashes = 0, total_free = 0;
+    for (const PartCount& count : counts) {
+      total_hashes += count.hashes;
+      total_free += count.free;
+    }
     auto stop = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::seconds>(stop - start);
 
-    std::cout << "Loaded " << total_hashes << " hashes." << std::endl;
+    std::cout << "Loaded " << total_hashes << " hashes";
+    if (first_record > 0) {
+      std::cout << " past the " << first_record << " records of the snapshot";
+    }
+    std::cout << "." << std::endl;
     std::cout << "There's " << total_free << " free records in the DB." << std::endl;
     std::cout << "Took " << duration.count() << " seconds." << std::endl;
   }
 
   bool Add(const std::string& ahv) {
-    std::string hash = hasher_.ComputeHash(ahv);
-    int64_t* possible_record_indexes;
-    int count;
-    cache_.Find(hash, &possible_record_indexes, &count);
-    bool found = false;
-    for (int i = 0; i < count; ++i) {
-      if (store_.HashAtEquals(possible_record_indexes[i], hash)) {
-        found = true;
-        break;
-      }
+    AHVHash hash = hasher_.ComputeHash(ahv);
+    std::lock_guard<std::mutex> lock(WriteMutex(hash));
+    int64_t record_index;
+    if (FindRecord(hash, &record_index)) return false;
+    record_index = store_->Add(hash);
+    if (fingerprints_ != nullptr) {
+      fingerprints_->Set(record_index, hash);
     }
-    delete[] possible_record_indexes;
-    if (found) return false;
-    int64_t record_index = store_.Add(hash);
-    cache_.Add(hash, record_index);
+    cache_->Add(hash, record_index);
     return true;
   }
 
   bool Remove(const std::string& ahv) {
-    std::string hash = hasher_.ComputeHash(ahv);
-    int64_t* possible_record_indexes;
-    int count;
-    cache_.Find(hash, &possible_record_indexes, &count);
-    bool found = false;
-    for (int i = 0; i < count; ++i) {
-      if (store_.HashAtEquals(possible_record_indexes[i], hash)) {
-        found = true;
-        store_.Remove(possible_record_indexes[i]);
-        cache_.Remove(hash, possible_record_indexes[i]);
-        break;
-      }
+    AHVHash hash = hasher_.ComputeHash(ahv);
+    std::lock_guard<std::mutex> lock(WriteMutex(hash));
+    int64_t record_index;
+    if (!FindRecord(hash, &record_index)) return false;
+    store_->Remove(record_index);
+    // After the store, a removal missing from the journal is harmless.
+    if (journal_ != nullptr) {
+      journal_->Append(record_index, hash);
     }
-    delete[] possible_record_indexes;
-    return found;
+    cache_->Remove(hash, record_index);
+    return true;
   }
 
   bool Lookup(const std::string& ahv) {
-    std::string hash = hasher_.ComputeHash(ahv);
-    int64_t* possible_record_indexes;
-    int count;
-    cache_.Find(hash, &possible_record_indexes, &count);
-    bool found = false;
-    for (int i = 0; i < count; ++i) {
-      if (store_.HashAtEquals(possible_record_indexes[i], hash)) {
-        found = true;
-        break;
-      }
+    AHVHash hash = hasher_.ComputeHash(ahv);
+    AHVCandidates candidates;
+    cache_->Find(hash, &candidates);
+    return VerifyLookup(hash, candidates);
+  }
+
+  // Looks up many AHVs at once, found[i] tells whether ahvs[i] is known.
+  std::vector<bool> LookupBatch(const std::vector<std::string>& ahvs) {
+    std::vector<AHVHash> hashes;
+    hashes.reserve(ahvs.size());
+    for (const std::string& ahv : ahvs) {
+      hashes.push_back(hasher_.ComputeHash(ahv));
+    }
+    std::vector<AHVCandidates> candidates(hashes.size());
+    cache_->FindBatch(hashes.data(), hashes.size(), candidates.data());
+    std::vector<bool> found(hashes.size());
+    for (size_t i = 0; i < hashes.size(); ++i) {
+      found[i] = VerifyLookup(hashes[i], candidates[i]);
     }
-    delete[] possible_record_indexes;
     return found;
   }
 
+  // Counters and sizes of each cache shard, empty if the cache keeps none.
+  std::vector<AHVCacheShardStats> CacheStats() {
+    return cache_->GetStats();
+  }
+
+  // Writes a snapshot of the cache for the next Init and starts a new
+  // journal. Meant to be called once writes stopped, e.g. at shutdown.
+  // Returns false if the cache does not support snapshots or on errors.
+  bool WriteSnapshot() {
+    AHVSnapshotInfo info;
+    info.watermark = store_->RecordCount();
+    info.journal_id = std::random_device()() | ((uint64_t) std::random_device()() << 32);
+    auto start = std::chrono::high_resolution_clock::now();
+    if (!cache_->WriteSnapshot(snapshot_filename_, info)) return false;
+    journal_.reset(new AHVJournal(journal_filename_, info.journal_id));
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::cout << "Wrote snapshot of " << info.watermark << " records in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count()
+              << "ms." << std::endl;
+    return true;
+  }
+
  private:
+  // Reads the snapshot into the cache and replays the removals journaled
+  // since. Returns the first record the snapshot does not cover, 0 if there
+  // is no usable snapshot. Fingerprints for memory verification are only
+  // rebuilt by a full load.
+  int64_t ReadSnapshot() {
+    if (fingerprints_ != nullptr) return 0;
+    AHVSnapshotInfo info;
+    if (!cache_->ReadSnapshot(snapshot_filename_, &info)) return 0;
+    if (info.watermark > store_->RecordCount()) {
+      std::cerr << "Snapshot " << snapshot_filename_ << " is ahead of the store, delete it to load "
+                << "the store in full." << std::endl;
+      exit(1);
+    }
+    journal_.reset(new AHVJournal(journal_filename_, info.journal_id));
+    int64_t replayed = 0;
+    journal_->ForEach([&] (int64_t record_index, const AHVHash& hash) -> void {
+      if (record_index < info.watermark) {
+        cache_->Remove(hash, record_index);
+        ++replayed;
+      }
+    });
+    std::cout << "Read snapshot of " << info.watermark << " records, replayed "
+              << replayed << " removals." << std::endl;
+    return info.watermark;
+  }
+
+  static std::unique_ptr<AHVStore_Base> NewStore(const std::string& filename, AHVStoreType store_type) {
+    if (store_type == AHVStoreType::MMAP) return std::make_unique<AHVStore_Mmap>(filename);
+    return std::make_unique<AHVStore_File>(filename);
+  }
+
+  // Records counted by a bulk load thread, a cache line each.
+  struct alignas(64) PartCount {
+    int64_t hashes = 0;
+    int64_t free = 0;
+  };
+
+  // Add and Remove check the store before changing it, so two writes of the
+  // same hash must not interleave. Lookups take no lock.
+  std::mutex& WriteMutex(const AHVHash& hash) {
+    return write_mutexes_[hash.data[0]];
+  }
+
+  // Verifies the candidates of a lookup in memory if fingerprints are kept,
+  // against the store otherwise. Writes always check the store, they need
+  // the exact record.
+  bool VerifyLookup(const AHVHash& hash, const AHVCandidates& candidates) {
+    if (fingerprints_ == nullptr) {
+      int64_t record_index;
+      return VerifyCandidates(hash, candidates, &record_index);
+    }
+    for (int i = 0; i < candidates.size(); ++i) {
+      if (fingerprints_->Matches(candidates[i], hash)) {
+        CountRejected(hash, i);
+        return true;
+      }
+    }
+    CountRejected(hash, candidates.size());
+    return false;
+  }
+
+  // Verifies the cache candidates against the store, returns true and sets
+  // record_index if the hash is found.
+  bool FindRecord(const AHVHash& hash, int64_t* record_index) {
+    AHVCandidates candidates;
+    cache_->Find(hash, &candidates);
+    return VerifyCandidates(hash, candidates, record_index);
+  }
+
+  bool VerifyCandidates(const AHVHash& hash, const AHVCandidates& candidates, int64_t* record_index) {
+    for (int i = 0; i < candidates.size(); ++i) {
+      if (store_->HashAtEquals(candidates[i], hash)) {
+        *record_index = candidates[i];
+        CountRejected(hash, i);
+        return true;
+      }
+    }
+    CountRejected(hash, candidates.size());
+    return false;
+  }
+
+  // The candidates checked before the match, if any, were false positives.
+  void CountRejected(const AHVHash& hash, int rejected) {
+    if (rejected > 0) {
+      cache_->CountRejected(hash, rejected);
+    }
+  }
+
   BCryptHasher hasher_;
-  AHVCache_Radix cache_;
-  AHVStore_File store_;
+  std::unique_ptr<AHVCache_Base> cache_;
+  std::unique_ptr<AHVStore_Base> store_;
+  std::unique_ptr<AHVFingerprintTable> fingerprints_;  // Null unless verifying in memory.
+  std::string snapshot_filename_;
+  std::string journal_filename_;
+  std::unique_ptr<AHVJournal> journal_;  // Null until a snapshot is read or written.
+  std::mutex write_mutexes_[256];
 };
 
 #endif  // AHV_DEFENDER_AHV_DISK_DATABASE_H_
\ No newline at end of file
@@ -0,0 +1,151 @@
+#ifndef AHV_DEFENDER_AHV_EPOCH_H_
+#define AHV_DEFENDER_AHV_EPOCH_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Epoch based reclamation. Readers wrap their accesses to shared structures in
+// a Guard and take no lock. Writers unlink an object, then Retire it instead of
+// deleting it; the object is deleted once every reader that might still hold a
+// pointer to it has left its Guard.
+//
+// A reader announces the global epoch in its slot when entering a Guard and
+// clears the slot when leaving. Retiring bumps the global epoch, so readers
+// that announce a later epoch entered after the object was unlinked and can
+// no longer reach it.
+class AHVEpoch {
+ public:
+  static AHVEpoch& Global() {
+    static AHVEpoch epoch;
+    return epoch;
+  }
+
+  class Guard {
+   public:
+    Guard() {
+      Global().Enter();
+    }
+
+    ~Guard() {
+      Global().Exit();
+    }
+
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+  };
+
+  static const int MAX_THREADS = 1024;
+
+  // Slot of the calling thread, below MAX_THREADS. No two running threads
+  // share a slot, the slot of a thread that exited is handed to a later one.
+  static int ThreadSlot() {
+    ThreadState& state = State();
+    if (state.slot < 0) {
+      state.slot = Global().AcquireSlot();
+    }
+    return state.slot;
+  }
+
+  template <typename T>
+  void Retire(T* object) {
+    uint64_t epoch = epoch_.fetch_add(1);
+    std::lock_guard<std::mutex> lock(retired_mutex_);
+    retired_.emplace_back(epoch, [object] () -> void { delete object; });
+  }
+
+  // Deletes the retired objects no reader can reach anymore.
+  void Reclaim() {
+    // Objects retired after the slots are scanned might have been reached by
+    // readers the scan missed, only consider the ones retired before.
+    uint64_t min_active = epoch_.load();
+    for (int i = 0; i < MAX_THREADS; ++i) {
+      uint64_t epoch = slots_[i].epoch.load();
+      if (epoch != 0 && epoch < min_active) {
+        min_active = epoch;
+      }
+    }
+    std::vector<std::function<void()>> deleters;
+    retired_mutex_.lock();
+    size_t kept = 0;
+    for (size_t i = 0; i < retired_.size(); ++i) {
+      if (retired_[i].first < min_active) {
+        deleters.push_back(std::move(retired_[i].second));
+      } else {
+        retired_[kept++] = std::move(retired_[i]);
+      }
+    }
+    retired_.resize(kept);
+    retired_mutex_.unlock();
+    for (auto& deleter : deleters) {
+      deleter();
+    }
+  }
+
+  ~AHVEpoch() {
+    for (auto& retired : retired_) {
+      retired.second();
+    }
+  }
+
+ private:
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> in_use{false};
+  };
+
+  // Slot of the calling thread, released when the thread exits.
+  struct ThreadState {
+    ~ThreadState() {
+      if (slot >= 0) {
+        Global().slots_[slot].in_use.store(false);
+      }
+    }
+
+    int slot = -1;
+    int depth = 0;
+  };
+
+  AHVEpoch() = default;
+
+  static ThreadState& State() {
+    thread_local ThreadState state;
+    return state;
+  }
+
+  void Enter() {
+    ThreadState& state = State();
+    if (state.depth++ > 0) return;
+    slots_[ThreadSlot()].epoch.store(epoch_.load());
+  }
+
+  void Exit() {
+    ThreadState& state = State();
+    if (--state.depth > 0) return;
+    slots_[state.slot].epoch.store(0, std::memory_order_release);
+  }
+
+  int AcquireSlot() {
+    for (int i = 0; i < MAX_THREADS; ++i) {
+      bool expected = false;
+      if (!slots_[i].in_use.load(std::memory_order_relaxed) &&
+          slots_[i].in_use.compare_exchange_strong(expected, true)) {
+        return i;
+      }
+    }
+    std::cerr << "AHVEpoch supports at most " << MAX_THREADS << " threads." << std::endl;
+    exit(1);
+  }
+
+  Slot slots_[MAX_THREADS];
+  std::atomic<uint64_t> epoch_{1};
+
+  std::mutex retired_mutex_;
+  std::vector<std::pair<uint64_t, std::function<void()>>> retired_;
+};
+
+#endif  // AHV_DEFENDER_AHV_EPOCH_H_
@@ -0,0 +1,36 @@
+#ifndef AHV_DEFENDER_AHV_FILE_IO_H_
+#define AHV_DEFENDER_AHV_FILE_IO_H_
+
+#include <cerrno>
+#include <cstddef>
+#include <unistd.h>
+
+// pwrite / pread of whole buffers, false on errors and short files. Retried
+// when interrupted or partial.
+inline bool AHVWriteAt(int fd, const void* data, size_t bytes, off_t offset) {
+  const char* p = (const char*) data;
+  while (bytes > 0) {
+    ssize_t written = pwrite(fd, p, bytes, offset);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    p += written;
+    bytes -= written;
+    offset += written;
+  }
+  return true;
+}
+
+inline bool AHVReadAt(int fd, void* data, size_t bytes, off_t offset) {
+  char* p = (char*) data;
+  while (bytes > 0) {
+    ssize_t count = pread(fd, p, bytes, offset);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return false;
+    p += count;
+    bytes -= count;
+    offset += count;
+  }
+  return true;
+}
+
+#endif  // AHV_DEFENDER_AHV_FILE_IO_H_
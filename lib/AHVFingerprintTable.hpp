@@ -0,0 +1,80 @@
+#ifndef AHV_DEFENDER_AHV_FINGERPRINT_TABLE_H_
+#define AHV_DEFENDER_AHV_FINGERPRINT_TABLE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#include "AHVHash.hpp"
+#include "AHVMmapArray.hpp"
+
+// 64 bit fingerprint of the hash in every store record, so that cache
+// candidates can be verified without reading the store. Fingerprints are
+// bytes 11-18 of the raw hash, disjoint from the bytes the caches select
+// candidates with (radix: 0-7 at most, cuckoo: 0-10), so for an unknown hash
+// each candidate matches with probability 2^-64 independently of how it was
+// selected.
+//
+// Indexed by record index, in segments mapped on first use. Set is called by
+// writers before the record is added to the cache, Matches takes no lock.
+class AHVFingerprintTable {
+ public:
+  AHVFingerprintTable() : segments_(new std::atomic<Segment*>[MAX_SEGMENTS]()) { }
+
+  ~AHVFingerprintTable() {
+    for (int64_t s = 0; s < MAX_SEGMENTS; ++s) {
+      delete segments_[s].load();
+    }
+  }
+
+  void Set(int64_t record_index, const AHVHash& hash) {
+    int64_t s = record_index >> SEGMENT_BITS;
+    if (s >= MAX_SEGMENTS) {
+      std::cerr << "Record index " << record_index << " does not fit the fingerprint table." << std::endl;
+      exit(1);
+    }
+    Segment* segment = segments_[s].load(std::memory_order_acquire);
+    if (segment == nullptr) {
+      std::lock_guard<std::mutex> lock(segments_mutex_);
+      segment = segments_[s].load(std::memory_order_relaxed);
+      if (segment == nullptr) {
+        segment = new Segment(SEGMENT_SIZE);
+        segments_[s].store(segment, std::memory_order_release);
+      }
+    }
+    (*segment)[record_index & (SEGMENT_SIZE - 1)].store(Fingerprint(hash), std::memory_order_relaxed);
+  }
+
+  // True if the record at record_index probably holds hash: always if it
+  // does, with probability 2^-64 otherwise.
+  bool Matches(int64_t record_index, const AHVHash& hash) const {
+    int64_t s = record_index >> SEGMENT_BITS;
+    if (s >= MAX_SEGMENTS) return false;
+    const Segment* segment = segments_[s].load(std::memory_order_acquire);
+    if (segment == nullptr) return false;
+    return (*segment)[record_index & (SEGMENT_SIZE - 1)].load(std::memory_order_relaxed) == Fingerprint(hash);
+  }
+
+ private:
+  static const int SEGMENT_BITS = 20;
+  static const int64_t SEGMENT_SIZE = (int64_t) 1 << SEGMENT_BITS;
+  // 16G records, as many as the radix cache addresses.
+  static const int64_t MAX_SEGMENTS = (int64_t) 1 << 14;
+
+  typedef AHVMmapArray<std::atomic<uint64_t>> Segment;
+
+  static uint64_t Fingerprint(const AHVHash& hash) {
+    uint64_t fingerprint;
+    memcpy((char*) &fingerprint, hash.data + 11, 8);
+    return fingerprint;
+  }
+
+  std::unique_ptr<std::atomic<Segment*>[]> segments_;
+  std::mutex segments_mutex_;
+};
+
+#endif  // AHV_DEFENDER_AHV_FINGERPRINT_TABLE_H_
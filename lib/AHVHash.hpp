@@ -0,0 +1,58 @@
+#ifndef AHV_DEFENDER_AHV_HASH_H_
+#define AHV_DEFENDER_AHV_HASH_H_
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+
+#include "BCryptBase64.hpp"
+
+// Size of the raw bcrypt hash output.
+#define AHV_HASH_LEN 23
+
+// The raw bcrypt hash of an AHV. Trivially copyable, so it can be passed
+// around, stored in containers and written to disk without allocating.
+struct AHVHash {
+  bool operator==(const AHVHash& other) const {
+    return memcmp(data, other.data, AHV_HASH_LEN) == 0;
+  }
+
+  bool operator!=(const AHVHash& other) const {
+    return !(*this == other);
+  }
+
+  // Converts from / to the 31 character bcrypt base64 form.
+  static AHVHash FromBase64(const char* text) {
+    AHVHash hash;
+    BCryptBase64::Decode(text, AHV_HASH_LEN, hash.data);
+    return hash;
+  }
+
+  std::string ToBase64() const {
+    std::string text(31, '\0');
+    BCryptBase64::Encode(data, AHV_HASH_LEN, &text[0]);
+    return text;
+  }
+
+  unsigned char data[AHV_HASH_LEN];
+};
+
+static_assert(sizeof(AHVHash) == AHV_HASH_LEN, "AHVHash must not be padded.");
+
+namespace std {
+
+// BCrypt output bits are uniformly distributed, the first 8 bytes are a good
+// enough hash on their own.
+template <>
+struct hash<AHVHash> {
+  size_t operator()(const AHVHash& hash) const {
+    uint64_t value;
+    memcpy(&value, hash.data, sizeof(value));
+    return (size_t) value;
+  }
+};
+
+}  // namespace std
+
+#endif  // AHV_DEFENDER_AHV_HASH_H_
@@ -0,0 +1,99 @@
+#ifndef AHV_DEFENDER_AHV_JOURNAL_H_
+#define AHV_DEFENDER_AHV_JOURNAL_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "AHVHash.hpp"
+#include "AHVSnapshot.hpp"
+
+// Removals since the last cache snapshot. The store only ever appends
+// records, so replaying the snapshot, these removals and the records past
+// the snapshot watermark rebuilds the cache.
+//
+// A 16 byte header (magic and the id of the snapshot it follows) and 32 byte
+// records (record index, hash). Appends go straight to the file, a crash
+// loses at most the record being written. A lost removal only leaves a
+// candidate that verification against the store rejects.
+class AHVJournal {
+ public:
+  // Opens filename, starting it over unless it follows the snapshot id.
+  AHVJournal(const std::string& filename, uint64_t id) {
+    fd_ = open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+      std::cerr << "Could not open journal " << filename << "." << std::endl;
+      exit(1);
+    }
+    Header header;
+    if (AHVReadAt(fd_, &header, sizeof(header), 0) && memcmp(header.magic, MAGIC, 8) == 0 &&
+        header.id == id) {
+      return;
+    }
+    memcpy(header.magic, MAGIC, 8);
+    header.id = id;
+    if (ftruncate(fd_, 0) != 0 || !AHVWriteAt(fd_, &header, sizeof(header), 0)) {
+      std::cerr << "Could not reset journal " << filename << "." << std::endl;
+      exit(1);
+    }
+  }
+
+  ~AHVJournal() {
+    close(fd_);
+  }
+
+  AHVJournal(const AHVJournal&) = delete;
+  AHVJournal& operator=(const AHVJournal&) = delete;
+
+  void Append(int64_t record_index, const AHVHash& hash) {
+    Record record;
+    memset(&record, 0, sizeof(record));
+    record.record_index = record_index;
+    memcpy(record.hash, hash.data, AHV_HASH_LEN);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (write(fd_, &record, sizeof(record)) != sizeof(record)) {
+      std::cerr << "Could not append to the journal." << std::endl;
+    }
+  }
+
+  // Calls f(record index, hash) for the removals in order, ignoring a torn
+  // last record.
+  void ForEach(std::function<void(int64_t, const AHVHash&)> f) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    struct stat file_stat;
+    if (fstat(fd_, &file_stat) != 0) return;
+    int64_t count = ((int64_t) file_stat.st_size - (int64_t) sizeof(Header)) / (int64_t) sizeof(Record);
+    for (int64_t i = 0; i < count; ++i) {
+      Record record;
+      if (!AHVReadAt(fd_, &record, sizeof(record), sizeof(Header) + i * sizeof(Record))) return;
+      AHVHash hash;
+      memcpy(hash.data, record.hash, AHV_HASH_LEN);
+      f(record.record_index, hash);
+    }
+  }
+
+ private:
+  static constexpr const char* MAGIC = "AHVJRNL1";
+
+  struct Header {
+    char magic[8];
+    uint64_t id;
+  };
+
+  struct Record {
+    int64_t record_index;
+    unsigned char hash[24];
+  };
+
+  int fd_;
+  std::mutex mutex_;
+};
+
+#endif  // AHV_DEFENDER_AHV_JOURNAL_H_
@@ -0,0 +1,152 @@
+#ifndef AHV_DEFENDER_AHV_MMAP_ARRAY_H_
+#define AHV_DEFENDER_AHV_MMAP_ARRAY_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+
+#include "AHVFileIO.hpp"
+
+// Page backing of large arrays:
+//   * NONE: regular 4K pages.
+//   * TRANSPARENT: transparent huge pages where the kernel allows them.
+//   * EXPLICIT: pages from the hugetlbfs pool (vm.nr_hugepages), regular
+//     pages with transparent huge pages if the pool is exhausted.
+enum class AHVHugePages {
+  NONE,
+  TRANSPARENT,
+  EXPLICIT,
+};
+
+// Backing used by arrays constructed without an explicit one.
+inline AHVHugePages& AHVDefaultHugePages() {
+  static AHVHugePages huge_pages = AHVHugePages::TRANSPARENT;
+  return huge_pages;
+}
+
+// Fixed size array mapped straight from the kernel. The address space is
+// reserved without committing memory (MAP_NORESERVE), pages are only backed
+// once written, so the resident size follows what is actually stored. Huge
+// pages cut the TLB misses of random lookups into large arrays.
+//
+// Arrays under HEAP_ARRAY_SIZE bytes come from the heap instead, zeroed and
+// cache line aligned: a mapping costs at least a page and counts against
+// vm.max_map_count, which caches of many small shards would run into.
+template <typename T>
+class AHVMmapArray {
+ public:
+  explicit AHVMmapArray(size_t size, AHVHugePages huge_pages = AHVDefaultHugePages())
+      : data_(nullptr), size_(size), bytes_(0) {
+    if (size == 0) return;
+    if (size * sizeof(T) < HEAP_ARRAY_SIZE) {
+      data_ = Allocate(size);
+      return;
+    }
+    if (huge_pages == AHVHugePages::EXPLICIT) {
+      bytes_ = RoundUp(size * sizeof(T), HUGE_PAGE_SIZE);
+      data_ = Map(bytes_, MAP_HUGETLB);
+      if (data_ != nullptr) return;
+      static bool warned = false;
+      if (!warned) {
+        std::cerr << "No explicit huge pages available, using transparent huge pages." << std::endl;
+        warned = true;
+      }
+      huge_pages = AHVHugePages::TRANSPARENT;
+    }
+    bytes_ = RoundUp(size * sizeof(T), REGULAR_PAGE_SIZE);
+    data_ = Map(bytes_, 0);
+    if (data_ == nullptr) {
+      std::cerr << "Could not map " << bytes_ << " bytes." << std::endl;
+      exit(1);
+    }
+    if (huge_pages == AHVHugePages::TRANSPARENT) {
+      madvise(data_, bytes_, MADV_HUGEPAGE);
+    }
+  }
+
+  // Maps size elements of the file open as fd, starting at offset (a multiple
+  // of the page size). Copy on write, the file is never modified. Small
+  // arrays are read instead. get() is nullptr if the mapping failed.
+  AHVMmapArray(int fd, size_t offset, size_t size)
+      : data_(nullptr), size_(size), bytes_(0) {
+    if (size == 0) return;
+    if (size * sizeof(T) < HEAP_ARRAY_SIZE) {
+      data_ = Allocate(size);
+      if (!AHVReadAt(fd, data_, size * sizeof(T), offset)) {
+        free(data_);
+        data_ = nullptr;
+      }
+      return;
+    }
+    bytes_ = RoundUp(size * sizeof(T), REGULAR_PAGE_SIZE);
+    void* data = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+    data_ = data == MAP_FAILED ? nullptr : (T*) data;
+  }
+
+  ~AHVMmapArray() {
+    if (data_ == nullptr) return;
+    if (bytes_ > 0) {
+      munmap(data_, bytes_);
+    } else {
+      free(data_);
+    }
+  }
+
+  AHVMmapArray(const AHVMmapArray&) = delete;
+  AHVMmapArray& operator=(const AHVMmapArray&) = delete;
+
+  T& operator[](size_t i) {
+    return data_[i];
+  }
+
+  const T& operator[](size_t i) const {
+    return data_[i];
+  }
+
+  T* get() {
+    return data_;
+  }
+
+  const T* get() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  static const size_t REGULAR_PAGE_SIZE = 4096;
+  static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+  static const size_t HEAP_ARRAY_SIZE = 64 * 1024;
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  static size_t RoundUp(size_t bytes, size_t alignment) {
+    return (bytes + alignment - 1) / alignment * alignment;
+  }
+
+  static T* Allocate(size_t size) {
+    size_t bytes = RoundUp(size * sizeof(T), CACHE_LINE_SIZE);
+    void* data = aligned_alloc(CACHE_LINE_SIZE, bytes);
+    if (data == nullptr) {
+      std::cerr << "Could not allocate " << bytes << " bytes." << std::endl;
+      exit(1);
+    }
+    memset(data, 0, bytes);
+    return (T*) data;
+  }
+
+  static T* Map(size_t bytes, int extra_flags) {
+    void* data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | extra_flags, -1, 0);
+    return data == MAP_FAILED ? nullptr : (T*) data;
+  }
+
+  T* data_;
+  size_t size_;
+  size_t bytes_;
+};
+
+#endif  // AHV_DEFENDER_AHV_MMAP_ARRAY_H_
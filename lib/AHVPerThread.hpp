@@ -0,0 +1,55 @@
+#ifndef AHV_DEFENDER_AHV_PER_THREAD_H_
+#define AHV_DEFENDER_AHV_PER_THREAD_H_
+
+#include <atomic>
+#include <cstddef>
+
+#include "AHVEpoch.hpp"
+
+// An array of size values for each thread, allocated on the first use by the
+// thread and indexed by its AHVEpoch slot. Threads update their own array
+// without sharing cache lines with other threads, others only read it (e.g.
+// counters summed up for statistics). The array of a thread that exited is
+// kept, with its values, and reused by the next thread given the slot.
+template <typename T>
+class AHVPerThread {
+ public:
+  explicit AHVPerThread(size_t size) : size_(size) { }
+
+  ~AHVPerThread() {
+    for (int i = 0; i < AHVEpoch::MAX_THREADS; ++i) {
+      delete[] values_[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  AHVPerThread(const AHVPerThread&) = delete;
+  AHVPerThread& operator=(const AHVPerThread&) = delete;
+
+  // Array of the calling thread.
+  T* Local() {
+    std::atomic<T*>& slot = values_[AHVEpoch::ThreadSlot()];
+    T* values = slot.load(std::memory_order_relaxed);
+    if (values == nullptr) {
+      values = new T[size_]();
+      slot.store(values, std::memory_order_release);
+    }
+    return values;
+  }
+
+  // Calls f(values) for the array of each thread that used one so far.
+  template <typename F>
+  void ForEach(F f) const {
+    for (int i = 0; i < AHVEpoch::MAX_THREADS; ++i) {
+      const T* values = values_[i].load(std::memory_order_acquire);
+      if (values != nullptr) {
+        f(values);
+      }
+    }
+  }
+
+ private:
+  size_t size_;
+  std::atomic<T*> values_[AHVEpoch::MAX_THREADS] = {};
+};
+
+#endif  // AHV_DEFENDER_AHV_PER_THREAD_H_
@@ -0,0 +1,221 @@
+#ifndef AHV_DEFENDER_AHV_SEARCH_INDEX_H_
+#define AHV_DEFENDER_AHV_SEARCH_INDEX_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "AHVMmapArray.hpp"
+
+// How lower bounds are searched in sorted arrays of 32 or 64 bit keys:
+//   * BINARY: std::lower_bound, one dependent cache miss per halving.
+//   * EYTZINGER: binary search over the first key of every block of 16 keys,
+//     laid out in Eytzinger (breadth first) order so that the next levels can
+//     be prefetched, then a search within the block (2 cache lines).
+//   * INTERPOLATION: the keys are uniformly distributed hash bits, guess the
+//     position from where the key falls between the first and the last key,
+//     then gallop and binary search around the guess.
+enum class AHVSearch {
+  BINARY,
+  EYTZINGER,
+  INTERPOLATION,
+};
+
+// Search used by indexes constructed without an explicit one.
+inline AHVSearch& AHVDefaultSearch() {
+  static AHVSearch search = AHVSearch::EYTZINGER;
+  return search;
+}
+
+// Search structure over an immutable sorted array of keys (32 or 64 bit, the
+// Key of the methods), built once after the array is filled. The array itself
+// is not owned.
+class AHVSearchIndex {
+ public:
+  explicit AHVSearchIndex(AHVSearch search = AHVDefaultSearch())
+      : search_(search), min_key_(0), max_key_(0), blocks_(0) { }
+
+  template <typename Key>
+  void Build(const Key* keys, size_t size) {
+    if (size > 0) {
+      min_key_ = keys[0];
+      max_key_ = keys[size - 1];
+    }
+    if (search_ != AHVSearch::EYTZINGER) return;
+    blocks_ = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blocks_ == 0) return;
+    // 1-based, with room for the prefetches past the last level.
+    block_keys_.reset(new AHVMmapArray<uint64_t>(blocks_ + 1));
+    block_ranks_.reset(new AHVMmapArray<uint32_t>(blocks_ + 1));
+    size_t rank = 0;
+    BuildEytzinger(keys, &rank, 1);
+  }
+
+  // Memory held besides the keys.
+  size_t bytes() const {
+    return blocks_ == 0 ? 0 : (blocks_ + 1) * (sizeof(uint64_t) + sizeof(uint32_t));
+  }
+
+  // State of a search advanced one step at a time, so that the steps of
+  // several searches can be interleaved and their memory accesses overlap.
+  struct Cursor {
+    uint64_t key;
+    size_t k;
+    bool descending;
+  };
+
+  // Starts a search for key and prefetches the memory its first step reads.
+  void Start(uint64_t key, Cursor* cursor) const {
+    cursor->key = key;
+    cursor->k = 1;
+    cursor->descending = search_ == AHVSearch::EYTZINGER && blocks_ > 0;
+    if (cursor->descending) {
+      __builtin_prefetch(block_keys_->get() + 1);
+    }
+  }
+
+  // Advances the search by one level of the Eytzinger tree, prefetching what
+  // the next step reads. Returns false once the tree was descended, searches
+  // other than EYTZINGER do all their work in Finish.
+  bool Step(Cursor* cursor) const {
+    if (!cursor->descending) return false;
+    const uint64_t* block_keys = block_keys_->get();
+    size_t k = 2 * cursor->k + (block_keys[cursor->k] < cursor->key);
+    if (k <= blocks_) {
+      __builtin_prefetch(block_keys + k);
+      cursor->k = k;
+      return true;
+    }
+    cursor->k = FirstNotLess(k);
+    cursor->descending = false;
+    if (cursor->k != 0) {
+      __builtin_prefetch(block_ranks_->get() + cursor->k);
+    }
+    return false;
+  }
+
+  // Prefetches the block a descended search ends in.
+  template <typename Key>
+  void PrefetchBlock(const Key* keys, size_t size, const Cursor& cursor) const {
+    if (search_ != AHVSearch::EYTZINGER || blocks_ == 0) return;
+    size_t begin, end;
+    BlockRange(size, cursor.k, &begin, &end);
+    if (begin < end) {
+      __builtin_prefetch(keys + begin);
+      __builtin_prefetch(keys + end - 1);
+    }
+  }
+
+  // Completes the search, returns the same as LowerBound.
+  template <typename Key>
+  size_t Finish(const Key* keys, size_t size, Cursor* cursor) const {
+    if (search_ != AHVSearch::EYTZINGER) return LowerBound(keys, size, cursor->key);
+    if (blocks_ == 0) return 0;
+    while (Step(cursor)) { }
+    size_t begin, end;
+    BlockRange(size, cursor->k, &begin, &end);
+    return std::lower_bound(keys + begin, keys + end, cursor->key) - keys;
+  }
+
+  // Position of the first key not less than key, size if there is none.
+  template <typename Key>
+  size_t LowerBound(const Key* keys, size_t size, uint64_t key) const {
+    switch (search_) {
+      case AHVSearch::EYTZINGER:
+        return EytzingerLowerBound(keys, size, key);
+      case AHVSearch::INTERPOLATION:
+        return InterpolationLowerBound(keys, size, key);
+      default:
+        return std::lower_bound(keys, keys + size, key) - keys;
+    }
+  }
+
+ private:
+  static const size_t BLOCK_SIZE = 16;
+
+  // In-order traversal of the implicit tree assigns the block first keys in
+  // sorted order.
+  template <typename Key>
+  void BuildEytzinger(const Key* keys, size_t* rank, size_t k) {
+    if (k > blocks_) return;
+    BuildEytzinger(keys, rank, 2 * k);
+    (*block_keys_)[k] = keys[*rank * BLOCK_SIZE];
+    (*block_ranks_)[k] = (uint32_t) *rank;
+    ++*rank;
+    BuildEytzinger(keys, rank, 2 * k + 1);
+  }
+
+  template <typename Key>
+  size_t EytzingerLowerBound(const Key* keys, size_t size, uint64_t key) const {
+    if (blocks_ == 0) return 0;
+    const uint64_t* block_keys = block_keys_->get();
+    size_t k = 1;
+    while (k <= blocks_) {
+      // The 8 great-grandchildren of k share a cache line.
+      __builtin_prefetch(block_keys + 8 * k);
+      k = 2 * k + (block_keys[k] < key);
+    }
+    size_t begin, end;
+    BlockRange(size, FirstNotLess(k), &begin, &end);
+    return std::lower_bound(keys + begin, keys + end, key) - keys;
+  }
+
+  // Undoes the right turns taken after the last left turn of a search that
+  // fell off the tree at k. Returns the Eytzinger position of the first
+  // block key not less than the searched key, or 0 if there is none.
+  static size_t FirstNotLess(size_t k) {
+    return k >> __builtin_ffsll(~k);
+  }
+
+  // Range of keys holding the lower bound, given the position of the first
+  // block key not less than the searched key. The first key of the previous
+  // block is less than the searched key.
+  void BlockRange(size_t size, size_t k, size_t* begin, size_t* end) const {
+    size_t block = k == 0 ? blocks_ : (*block_ranks_)[k];
+    *begin = block == 0 ? 0 : (block - 1) * BLOCK_SIZE + 1;
+    *end = std::min(size, block * BLOCK_SIZE);
+  }
+
+  // Keys need not span the whole 64 bits (compressed serving areas search
+  // fingerprints, narrow layouts pack fewer bits), the guess is relative to
+  // the range of the keys.
+  template <typename Key>
+  size_t InterpolationLowerBound(const Key* keys, size_t size, uint64_t key) const {
+    if (size == 0 || key <= min_key_) return 0;
+    if (key > max_key_) return size;
+    size_t guess = (size_t) ((unsigned __int128) (key - min_key_) * (size - 1) / (max_key_ - min_key_));
+    size_t begin, end;
+    if (keys[guess] < key) {
+      // Gallop right until a key not less than key.
+      size_t step = 1;
+      begin = guess + 1;
+      end = guess + 1;
+      while (end < size && keys[end] < key) {
+        begin = end + 1;
+        end = std::min(size, end + step);
+        step *= 2;
+      }
+    } else {
+      // Gallop left until a key less than key.
+      size_t step = 1;
+      begin = guess;
+      end = guess;
+      while (begin > 0 && keys[begin - 1] >= key) {
+        end = begin - 1;
+        begin = begin > step ? begin - step : 0;
+        step *= 2;
+      }
+    }
+    return std::lower_bound(keys + begin, keys + end, key) - keys;
+  }
+
+  AHVSearch search_;
+  uint64_t min_key_;
+  uint64_t max_key_;
+  size_t blocks_;
+  std::unique_ptr<AHVMmapArray<uint64_t>> block_keys_;
+  std::unique_ptr<AHVMmapArray<uint32_t>> block_ranks_;
+};
+
+#endif  // AHV_DEFENDER_AHV_SEARCH_INDEX_H_
@@ -0,0 +1,83 @@
+#ifndef AHV_DEFENDER_AHV_SNAPSHOT_H_
+#define AHV_DEFENDER_AHV_SNAPSHOT_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "AHVFileIO.hpp"
+
+// What a cache snapshot covers: the store records below watermark, minus the
+// removals logged in the journal tagged journal_id (see AHVJournal).
+struct AHVSnapshotInfo {
+  int64_t watermark;
+  uint64_t journal_id;
+};
+
+// Snapshot file layout, all integers little endian:
+//   * header: magic, version, cache layout, info and a checksum of the rest
+//     of the header and of the section table.
+//   * section table: offset, entry count and checksum of every section.
+//   * sections: arrays of entries (32 or 64 bit, as the layout packs them),
+//     each starting on a page boundary so that it can be mapped in place.
+// Files are written to a temporary name and renamed once synced, a snapshot
+// is either complete or absent.
+struct AHVSnapshotHeader {
+  static constexpr uint32_t VERSION = 1;
+  static constexpr size_t ALIGNMENT = 4096;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t sections;
+  // Caches reject snapshots of another layout.
+  uint32_t layout[4];
+  AHVSnapshotInfo info;
+  uint64_t checksum;
+};
+
+struct AHVSnapshotSection {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t checksum;
+};
+
+constexpr const char* AHV_SNAPSHOT_MAGIC = "AHVSNAPS";
+
+// Not cryptographic, catches truncated and corrupted files.
+inline uint64_t AHVChecksum(const void* data, size_t bytes, uint64_t seed = 0) {
+  const unsigned char* p = (const unsigned char*) data;
+  uint64_t h = seed ^ 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < bytes; ++i) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+inline uint64_t AHVChecksumWord(uint64_t h, uint64_t word) {
+  h = (h ^ word) * 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 29);
+}
+
+// Word at a time, for the large sections.
+inline uint64_t AHVChecksumWords(const uint64_t* words, size_t count) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < count; ++i) {
+    h = AHVChecksumWord(h, words[i]);
+  }
+  return h;
+}
+
+// Sections of 32 bit entries, two to a word as they are laid out in memory
+// (an odd last entry alone).
+inline uint64_t AHVChecksumWords(const uint32_t* entries, size_t count) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < count; i += 2) {
+    uint64_t word = entries[i];
+    if (i + 1 < count) {
+      word |= (uint64_t) entries[i + 1] << 32;
+    }
+    h = AHVChecksumWord(h, word);
+  }
+  return h;
+}
+
+#endif  // AHV_DEFENDER_AHV_SNAPSHOT_H_
@@ -0,0 +1,43 @@
+#ifndef AHV_DEFENDER_AHV_STORE_BASE_H_
+#define AHV_DEFENDER_AHV_STORE_BASE_H_
+
+#include <cstdint>
+#include <functional>
+
+#include "AHVHash.hpp"
+#include "DiskRecord.hpp"
+
+// Disk storage of the hashes, one record per index. Records are only ever
+// appended, removals free them in place. Implementations are safe to call
+// from multiple threads; reads need no lock.
+class AHVStore_Base {
+ public:
+  virtual ~AHVStore_Base() = default;
+
+  virtual DiskFormat format() const = 0;
+
+  // Number of records, used or free.
+  virtual int64_t RecordCount() = 0;
+
+  // Goes through the records starting at first_record.
+  virtual void ForEach(std::function<void(const AHVHash&, int64_t)> tell_record,
+                       std::function<void(int64_t)> tell_free,
+                       int64_t first_record = 0) = 0;
+
+  // ForEach split in parts ranges of consecutive records, each read by its
+  // own thread. The callbacks also get the part of the record; they are
+  // called concurrently for different parts, in record order within a part.
+  virtual void ParallelForEach(int parts,
+                               std::function<void(const AHVHash&, int64_t, int)> tell_record,
+                               std::function<void(int64_t, int)> tell_free,
+                               int64_t first_record = 0) = 0;
+
+  // Appends a record holding hash, returns its index.
+  virtual int64_t Add(const AHVHash& hash) = 0;
+
+  virtual void Remove(int64_t record_index) = 0;
+
+  virtual bool HashAtEquals(int64_t record_index, const AHVHash& hash) = 0;
+};
+
+#endif  // AHV_DEFENDER_AHV_STORE_BASE_H_
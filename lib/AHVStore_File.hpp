@@ -1,104 +1,274 @@
 #ifndef AHV_DEFENDER_AHV_STORE_FILE_H_
 #define AHV_DEFENDER_AHV_STORE_FILE_H_
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <fcntl.h>
 #include <iostream>
-#include <fstream>
 #include <functional>
 #include <mutex>
 #include <string>
 #include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
+#include "AHVFileIO.hpp"
+#include "AHVHash.hpp"
+#include "AHVStore_Base.hpp"
 #include "DiskRecord.hpp"
 
-class AHVStore_File {
+// Records are read and written in place with pread / pwrite on a single file
+// descriptor, so reads take no lock and run concurrently (as many as the disk
+// queues). Appends are serialized by append_mutex_ to hand out record
+// indexes; a record index only reaches the cache once its record is written.
+// Removals overwrite their own record, a lookup racing one reads either the
+// old record or the free one.
+class AHVStore_File : public AHVStore_Base {
  public:
-  AHVStore_File(const std::string& filename) {
-    if (!FileExists(filename)) {
-      CreateEmptyFile(filename);
+  AHVStore_File(const std::string& filename) : filename_(filename) {
+    fd_ = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0) {
+      std::cerr << "Could not open " << filename_ << "." << std::endl;
+      exit(1);
     }
-    fs_.open(filename, std::ios::binary | std::ios::in | std::ios::out);
+    if (FileSize() == 0 && !AHVWriteAt(fd_, (const char*) &DiskHeader::current(), sizeof(DiskHeader), 0)) {
+      std::cerr << "Could not write the header of " << filename_ << "." << std::endl;
+      exit(1);
+    }
+    DetectFormat();
+    // A torn last record (legacy files) is overwritten by the next add.
+    record_count_ = std::max((int64_t) 0, FileSize() - header_size_) / record_size_;
   }
 
-  ~AHVStore_File() {
-    fs_.close();
+  ~AHVStore_File() override {
+    close(fd_);
     std::cout << "File store cleanly destructed." << std::endl;
   }
 
-  void ForEach(std::function<void(const char*, int64_t)> tell_record,
-               std::function<void(int64_t)> tell_free) {
-    fs_mutex_.lock();
-    fs_.seekg(0, std::ios::end);
-    int64_t remaining = fs_.tellg();
-    fs_.seekg(0, std::ios::beg);
+  DiskFormat format() const override {
+    return format_;
+  }
+
+  int64_t RecordCount() override {
+    return record_count_.load(std::memory_order_acquire);
+  }
+
+  void ForEach(std::function<void(const AHVHash&, int64_t)> tell_record,
+               std::function<void(int64_t)> tell_free,
+               int64_t first_record = 0) override {
+    int64_t remaining = std::max((int64_t) 0, RecordCount() - first_record) * record_size_;
+    // Only whole records per read, 4080 bytes (170 records) for the compact
+    // format and 4096 bytes (128 records) for the legacy one.
+    const int buffer_size = (4096 / record_size_) * record_size_;
     char buffer[4096];
-    int64_t record_index = 0;
-    while(remaining > 0) {
-      int count = remaining < 4096 ? (int) remaining : 4096;
-      fs_.read(buffer, count);
+    int64_t record_index = first_record;
+    while (remaining > 0) {
+      int count = remaining < buffer_size ? (int) remaining : buffer_size;
+      if (!AHVReadAt(fd_, buffer, count, RecordOffset(record_index))) {
+        std::cerr << "Could not read " << filename_ << "." << std::endl;
+        exit(1);
+      }
       int buffer_index = 0;
       while (buffer_index < count) {
-        if (*(buffer + buffer_index) == 0x01) {
-          tell_record(buffer + buffer_index, record_index);
+        AHVHash hash;
+        if (DecodeRecord(buffer + buffer_index, &hash)) {
+          tell_record(hash, record_index);
         } else {
           tell_free(record_index);
         }
-        record_index += 32;
-        if ((record_index / 32) % 100000 == 0) {
-          std::cout << "Loaded " << (record_index / 32) << " hashes..." << std::endl;
+        ++record_index;
+        if (record_index % 100000 == 0) {
+          std::cout << "Loaded " << record_index << " hashes..." << std::endl;
         }
-        buffer_index += 32;
+        buffer_index += record_size_;
       }
       remaining -= count;
     }
-    fs_mutex_.unlock();
   }
 
-  int64_t Add(const std::string& hash) {
+  // Each part is read in large sequential reads.
+  void ParallelForEach(int parts,
+                       std::function<void(const AHVHash&, int64_t, int)> tell_record,
+                       std::function<void(int64_t, int)> tell_free,
+                       int64_t first_record = 0) override {
+    ForEachPart(parts, first_record, [&] (int64_t begin, int64_t end, int part, Progress* progress) -> void {
+      // A file descriptor per thread, so that each range gets its own
+      // readahead.
+      int fd = open(filename_.c_str(), O_RDONLY);
+      if (fd < 0) {
+        std::cerr << "Could not open " << filename_ << "." << std::endl;
+        exit(1);
+      }
+      posix_fadvise(fd, RecordOffset(begin), (end - begin) * record_size_, POSIX_FADV_SEQUENTIAL);
+      std::vector<char> buffer(PARALLEL_READ_SIZE / record_size_ * record_size_);
+      int64_t buffer_records = buffer.size() / record_size_;
+      for (int64_t first = begin; first < end; first += buffer_records) {
+        int64_t count = std::min(buffer_records, end - first);
+        if (!AHVReadAt(fd, buffer.data(), count * record_size_, RecordOffset(first))) {
+          std::cerr << "Could not read " << filename_ << "." << std::endl;
+          exit(1);
+        }
+        TellRecords(buffer.data(), first, count, part, tell_record, tell_free);
+        progress->Add(count);
+      }
+      close(fd);
+    });
+  }
+
+  int64_t Add(const AHVHash& hash) override {
     // Prepare disk record.
-    DiskRecord disk_record;
-    disk_record.set_used(true);
-    memcpy(disk_record.data + 1, hash.c_str(), 31);
-
-    // Append.
-    fs_mutex_.lock();
-    fs_.seekp(0, std::ios::end);
-    int64_t record_index = fs_.tellp();
-    fs_.write((const char*) disk_record.data, 32);
-    fs_mutex_.unlock();
+    unsigned char data[32];
+    data[0] = 0x01;
+    EncodeHash(hash, data + 1);
+
+    // Append, publishing the record count once the record is written.
+    std::lock_guard<std::mutex> lock(append_mutex_);
+    int64_t record_index = record_count_.load(std::memory_order_relaxed);
+    if (!AHVWriteAt(fd_, (const char*) data, record_size_, RecordOffset(record_index))) {
+      std::cerr << "Could not append to " << filename_ << "." << std::endl;
+      exit(1);
+    }
+    record_count_.store(record_index + 1, std::memory_order_release);
     return record_index;
   }
 
-  void Remove(int64_t record_index) {
-    fs_mutex_.lock();
-    fs_.seekp(record_index);
-    fs_.write((const char*) DiskRecord::empty_record().data, 32);
-    fs_mutex_.unlock();
+  void Remove(int64_t record_index) override {
+    const unsigned char* empty = format_ == DiskFormat::COMPACT
+        ? DiskRecord::empty_record().data
+        : LegacyDiskRecord::empty_record().data;
+    if (!AHVWriteAt(fd_, (const char*) empty, record_size_, RecordOffset(record_index))) {
+      std::cerr << "Could not remove record " << record_index << " from " << filename_ << "." << std::endl;
+    }
+  }
+
+  bool HashAtEquals(int64_t record_index, const AHVHash& hash) override {
+    unsigned char expected[32], buffer[32];
+    expected[0] = 0x01;
+    EncodeHash(hash, expected + 1);
+    if (!AHVReadAt(fd_, (char*) buffer, record_size_, RecordOffset(record_index))) return false;
+    return memcmp(expected, buffer, record_size_) == 0;
+  }
+
+ protected:
+  static const int PARALLEL_READ_SIZE = 1 << 20;
+  static const int64_t PROGRESS_INTERVAL = 10000000;
+
+  // Records gone through by a ParallelForEach, reported every
+  // PROGRESS_INTERVAL records.
+  class Progress {
+   public:
+    void Add(int64_t count) {
+      int64_t total = loaded_.fetch_add(count) + count;
+      if (total / PROGRESS_INTERVAL != (total - count) / PROGRESS_INTERVAL) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cout << "Loaded " << total / PROGRESS_INTERVAL * PROGRESS_INTERVAL << " hashes..." << std::endl;
+      }
+    }
+
+   private:
+    std::atomic<int64_t> loaded_{0};
+    std::mutex mutex_;
+  };
+
+  // Splits the records from first_record on in parts ranges and calls
+  // read_range(begin, end, part, progress) for each, on its own thread.
+  void ForEachPart(int parts, int64_t first_record,
+                   std::function<void(int64_t, int64_t, int, Progress*)> read_range) {
+    int64_t record_count = RecordCount();
+    int64_t part_size = (std::max((int64_t) 0, record_count - first_record) + parts - 1) / parts;
+    Progress progress;
+    std::vector<std::thread> threads;
+    for (int part = 0; part < parts; ++part) {
+      threads.emplace_back([&, part] () -> void {
+        int64_t begin = std::min(record_count, first_record + part * part_size);
+        int64_t end = std::min(record_count, begin + part_size);
+        read_range(begin, end, part, &progress);
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
   }
 
-  bool HashAtEquals(int64_t record_index, const std::string& hash) {
-    char buffer[31];
-    fs_mutex_.lock();
-    fs_.seekg(record_index + 1);
-    fs_.read(buffer, 31);
-    fs_mutex_.unlock();
-    return strncmp(hash.c_str(), buffer, 31) == 0;
+  // Calls tell_record or tell_free for the count records at data, the first
+  // of which is first.
+  void TellRecords(const char* data, int64_t first, int64_t count, int part,
+                   const std::function<void(const AHVHash&, int64_t, int)>& tell_record,
+                   const std::function<void(int64_t, int)>& tell_free) const {
+    for (int64_t i = 0; i < count; ++i) {
+      AHVHash hash;
+      if (DecodeRecord(data + i * record_size_, &hash)) {
+        tell_record(hash, first + i, part);
+      } else {
+        tell_free(first + i, part);
+      }
+    }
   }
 
- private:
-  static bool FileExists(const std::string& filename) {
+  int64_t FileSize() const {
     struct stat buffer;
-    return stat(filename.c_str(), &buffer) == 0;
+    if (fstat(fd_, &buffer) != 0) return 0;
+    return buffer.st_size;
   }
 
-  static void CreateEmptyFile(const std::string& filename) {
-    std::ofstream output(filename);
-    output.close();
+  // Files starting with the header magic are compact, anything else is a
+  // legacy file written before the header was introduced.
+  void DetectFormat() {
+    DiskHeader header;
+    memset(&header, 0, sizeof(header));
+    bool has_header = AHVReadAt(fd_, (char*) &header, sizeof(header), 0) &&
+                      DiskHeader::HasMagic((const unsigned char*) header.magic);
+    if (has_header) {
+      if (header.version != DiskHeader::current().version ||
+          header.record_size != DiskHeader::current().record_size) {
+        std::cerr << "Unsupported store version " << header.version << "." << std::endl;
+        exit(1);
+      }
+      format_ = DiskFormat::COMPACT;
+      header_size_ = sizeof(DiskHeader);
+      record_size_ = sizeof(DiskRecord);
+    } else {
+      std::cout << "Legacy store format detected, consider converting it with db-convert." << std::endl;
+      format_ = DiskFormat::LEGACY;
+      header_size_ = 0;
+      record_size_ = sizeof(LegacyDiskRecord);
+    }
   }
 
-  std::fstream fs_;
-  std::mutex fs_mutex_;
+  // Writes the hash as it is laid out on disk after the used flag.
+  void EncodeHash(const AHVHash& hash, unsigned char* out) const {
+    if (format_ == DiskFormat::COMPACT) {
+      memcpy(out, hash.data, AHV_HASH_LEN);
+    } else {
+      BCryptBase64::Encode(hash.data, AHV_HASH_LEN, (char*) out);
+    }
+  }
+
+  int64_t RecordOffset(int64_t record_index) const {
+    return header_size_ + record_index * record_size_;
+  }
+
+  // False if the record at data is free.
+  bool DecodeRecord(const char* data, AHVHash* hash) const {
+    if (*data != 0x01) return false;
+    if (format_ == DiskFormat::COMPACT) {
+      *hash = ((const DiskRecord*) data)->hash();
+    } else {
+      *hash = AHVHash::FromBase64(data + 1);
+    }
+    return true;
+  }
+
+  std::string filename_;
+  DiskFormat format_;
+  int64_t header_size_;
+  int record_size_;
+
+  int fd_;
+  std::atomic<int64_t> record_count_;
+  std::mutex append_mutex_;  // Add only.
 };
 
-#endif  // AHV_DEFENDER_AHV_STORE_FILE_H_
\ No newline at end of file
+#endif  // AHV_DEFENDER_AHV_STORE_FILE_H_
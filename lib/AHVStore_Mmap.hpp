@@ -0,0 +1,126 @@
+#ifndef AHV_DEFENDER_AHV_STORE_MMAP_H_
+#define AHV_DEFENDER_AHV_STORE_MMAP_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <vector>
+
+#include "AHVHash.hpp"
+#include "AHVStore_File.hpp"
+
+// File store whose reads go through a shared, read only mapping of the file:
+// verifying a candidate costs a memory access (a page fault the first time)
+// instead of a syscall. Meant for stores that fit the page cache. Writes
+// still go through pwrite (see AHVStore_File), the page cache keeps the
+// mapping coherent with them.
+//
+// The mapping reaches past the end of the file, so appended records are
+// mapped as soon as they are written. It is only remapped, twice as large,
+// once the file outgrows it. Previous mappings stay until the store is
+// destructed since lookups may still be reading them. Bulk loads read the
+// mapping with sequential access hints, lookups with random ones.
+//
+// The file must not be truncated by anyone else while mapped, reads past its
+// end raise SIGBUS.
+class AHVStore_Mmap : public AHVStore_File {
+ public:
+  AHVStore_Mmap(const std::string& filename) : AHVStore_File(filename), mapping_(nullptr) {
+    Map(std::max(MIN_MAPPING_SIZE, (size_t) RecordOffset(RecordCount()) * 2));
+  }
+
+  ~AHVStore_Mmap() override {
+    for (const std::unique_ptr<Mapping>& mapping : mappings_) {
+      munmap(mapping->data, mapping->bytes);
+    }
+  }
+
+  void ForEach(std::function<void(const AHVHash&, int64_t)> tell_record,
+               std::function<void(int64_t)> tell_free,
+               int64_t first_record = 0) override {
+    ParallelForEach(
+        1,
+        [&] (const AHVHash& hash, int64_t index, int part) -> void { tell_record(hash, index); },
+        [&] (int64_t index, int part) -> void { tell_free(index); },
+        first_record);
+  }
+
+  void ParallelForEach(int parts,
+                       std::function<void(const AHVHash&, int64_t, int)> tell_record,
+                       std::function<void(int64_t, int)> tell_free,
+                       int64_t first_record = 0) override {
+    const Mapping* mapping = mapping_.load(std::memory_order_acquire);
+    madvise(mapping->data, mapping->bytes, MADV_SEQUENTIAL);
+    ForEachPart(parts, first_record, [&] (int64_t begin, int64_t end, int part, Progress* progress) -> void {
+      int64_t chunk_records = PARALLEL_READ_SIZE / record_size_;
+      for (int64_t first = begin; first < end; first += chunk_records) {
+        int64_t count = std::min(chunk_records, end - first);
+        TellRecords(mapping->data + RecordOffset(first), first, count, part, tell_record, tell_free);
+        progress->Add(count);
+      }
+    });
+    madvise(mapping->data, mapping->bytes, MADV_RANDOM);
+  }
+
+  // Grows the mapping before the record index is handed out.
+  int64_t Add(const AHVHash& hash) override {
+    int64_t record_index = AHVStore_File::Add(hash);
+    size_t end = RecordOffset(record_index + 1);
+    if (end > mapping_.load(std::memory_order_acquire)->bytes) {
+      std::lock_guard<std::mutex> lock(map_mutex_);
+      if (end > mapping_.load(std::memory_order_relaxed)->bytes) {
+        Map(std::max(end, mapping_.load(std::memory_order_relaxed)->bytes * 2));
+      }
+    }
+    return record_index;
+  }
+
+  bool HashAtEquals(int64_t record_index, const AHVHash& hash) override {
+    // Never past the end of the file.
+    if (record_index < 0 || record_index >= RecordCount()) return false;
+    const Mapping* mapping = mapping_.load(std::memory_order_acquire);
+    // Only a record still being added can be past the mapping.
+    if ((size_t) RecordOffset(record_index + 1) > mapping->bytes) {
+      return AHVStore_File::HashAtEquals(record_index, hash);
+    }
+    unsigned char expected[32];
+    expected[0] = 0x01;
+    EncodeHash(hash, expected + 1);
+    return memcmp(expected, mapping->data + RecordOffset(record_index), record_size_) == 0;
+  }
+
+ private:
+  static constexpr size_t MIN_MAPPING_SIZE = (size_t) 1 << 30;
+  static constexpr size_t MAP_ALIGNMENT = 4096;
+
+  struct Mapping {
+    char* data;  // Read only.
+    size_t bytes;
+  };
+
+  // Maps the first bytes of the file (rounded up to whole pages) and makes
+  // that the current mapping.
+  void Map(size_t bytes) {
+    bytes = (bytes + MAP_ALIGNMENT - 1) / MAP_ALIGNMENT * MAP_ALIGNMENT;
+    void* data = mmap(nullptr, bytes, PROT_READ, MAP_SHARED | MAP_NORESERVE, fd_, 0);
+    if (data == MAP_FAILED) {
+      std::cerr << "Could not map " << bytes << " bytes of " << filename_ << "." << std::endl;
+      exit(1);
+    }
+    madvise(data, bytes, MADV_RANDOM);
+    mappings_.emplace_back(new Mapping{(char*) data, bytes});
+    mapping_.store(mappings_.back().get(), std::memory_order_release);
+  }
+
+  std::atomic<const Mapping*> mapping_;  // The last of mappings_.
+  std::vector<std::unique_ptr<Mapping>> mappings_;
+  std::mutex map_mutex_;
+};
+
+#endif  // AHV_DEFENDER_AHV_STORE_MMAP_H_
@@ -0,0 +1,69 @@
+#ifndef AHV_DEFENDER_BCRYPT_BASE64_H_
+#define AHV_DEFENDER_BCRYPT_BASE64_H_
+
+#include <cstdint>
+
+// BCrypt uses its own base64 alphabet ("./A-Za-z0-9") with no padding. The 31
+// characters at the end of a bcrypt string encode 23 bytes (184 bits) of raw
+// hash output, the last character only carrying 4 meaningful bits and 2 bits
+// of padding.
+class BCryptBase64 {
+ public:
+  // Decodes as many characters from src as needed to fill size bytes of dst.
+  // Characters outside of the alphabet decode as zero bits, so arbitrary
+  // (e.g. fake) data still maps to a deterministic value.
+  static void Decode(const char* src, int size, unsigned char* dst) {
+    const unsigned char* sptr = (const unsigned char*) src;
+    unsigned char* end = dst + size;
+    while (dst < end) {
+      uint32_t c1 = Value(*sptr++);
+      uint32_t c2 = Value(*sptr++);
+      *dst++ = (unsigned char) ((c1 << 2) | ((c2 & 0x30) >> 4));
+      if (dst >= end) break;
+      uint32_t c3 = Value(*sptr++);
+      *dst++ = (unsigned char) (((c2 & 0x0f) << 4) | ((c3 & 0x3c) >> 2));
+      if (dst >= end) break;
+      uint32_t c4 = Value(*sptr++);
+      *dst++ = (unsigned char) (((c3 & 0x03) << 6) | c4);
+    }
+  }
+
+  // Encodes size bytes of src, writing (size * 8 + 5) / 6 characters to dst.
+  // No terminator is written.
+  static void Encode(const unsigned char* src, int size, char* dst) {
+    static const char alphabet[] =
+        "./ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    const unsigned char* end = src + size;
+    while (src < end) {
+      uint32_t c1 = *src++;
+      *dst++ = alphabet[c1 >> 2];
+      c1 = (c1 & 0x03) << 4;
+      if (src >= end) {
+        *dst++ = alphabet[c1];
+        break;
+      }
+      uint32_t c2 = *src++;
+      *dst++ = alphabet[c1 | (c2 >> 4)];
+      c1 = (c2 & 0x0f) << 2;
+      if (src >= end) {
+        *dst++ = alphabet[c1];
+        break;
+      }
+      c2 = *src++;
+      *dst++ = alphabet[c1 | (c2 >> 6)];
+      *dst++ = alphabet[c2 & 0x3f];
+    }
+  }
+
+ private:
+  static uint32_t Value(unsigned char c) {
+    if (c >= 'a' && c <= 'z') return c - 'a' + 28;
+    if (c >= 'A' && c <= 'Z') return c - 'A' + 2;
+    if (c >= '0' && c <= '9') return c - '0' + 54;
+    if (c == '.') return 0;
+    if (c == '/') return 1;
+    return 0;
+  }
+};
+
+#endif  // AHV_DEFENDER_BCRYPT_BASE64_H_
@@ -4,6 +4,8 @@
 #include <cstring>
 #include <string>
 
+#include "AHVHash.hpp"
+
 #define BCRYPT_INPUT_LEN 16
 #define BCRYPT_HASH_LEN 64
 #define BCRYPT_FACTOR 4
@@ -20,12 +22,12 @@ class BCryptHasher {
     crypt_gensalt_rn("$2a$", BCRYPT_FACTOR, (char*) input, BCRYPT_INPUT_LEN, setting, BCRYPT_HASH_LEN);
   }
 
-  std::string ComputeHash(const std::string& plaintext) const {
+  // The bcrypt output is "$2a$NN$", 22 salt characters and 31 hash
+  // characters. Only the hash part is kept, decoded to its raw bytes.
+  AHVHash ComputeHash(const std::string& plaintext) const {
     char hash[BCRYPT_HASH_LEN] = {0};
     crypt_rn(plaintext.c_str(), setting, hash, BCRYPT_HASH_LEN);
-    std::string result(hash);
-    result = result.substr(result.size() - 31);
-    return result;
+    return AHVHash::FromBase64(hash + 7 + 22);
   }
 
  private:
@@ -1,28 +1,107 @@
 #ifndef AHV_DEFENDER_DISK_RECORD_H_
 #define AHV_DEFENDER_DISK_RECORD_H_
 
+#include <cstdint>
 #include <cstring>
 
+#include "AHVHash.hpp"
+
+// Store file formats:
+//   * legacy: no header, 32 byte records holding 31 bcrypt base64 characters.
+//   * compact (version 2): a 24 byte header followed by 24 byte records
+//     holding the 23 raw bytes of the bcrypt hash.
+// Record indexes are slot numbers, so the i-th record of a legacy file has the
+// same index after conversion to the compact format.
+enum class DiskFormat {
+  LEGACY,
+  COMPACT,
+};
+
+struct DiskHeader {
+  static const DiskHeader& current() {
+    static bool initialized = false;
+    static DiskHeader header;
+    if (!initialized) {
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, MAGIC, 8);
+      header.version = 2;
+      header.record_size = 24;
+      initialized = true;
+    }
+    return header;
+  }
+
+  // Legacy files start with a used / free flag, never with the magic.
+  static bool HasMagic(const unsigned char* data) {
+    return memcmp(data, MAGIC, 8) == 0;
+  }
+
+  // Header layout:
+  //   * bytes 0-7: magic.
+  //   * bytes 8-11: format version.
+  //   * bytes 12-15: record size.
+  //   * bytes 16-23: reserved, zero.
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  unsigned char reserved[8];
+
+ private:
+  static constexpr const char* MAGIC = "AHVSTORE";
+};
+
 struct DiskRecord {
   void set_used(bool used) {
     data[0] = (unsigned char) (used ? 0x01 : 0x00);
   }
 
+  bool used() const {
+    return data[0] == 0x01;
+  }
+
+  void set_hash(const AHVHash& hash) {
+    memcpy(data + 1, hash.data, AHV_HASH_LEN);
+  }
+
+  const AHVHash& hash() const {
+    return *(const AHVHash*) (data + 1);
+  }
+
   static const DiskRecord& empty_record() {
     static bool initialized = false;
     static DiskRecord empty;
     if (!initialized) {
       empty.set_used(false);
-      memset((unsigned char*) empty.data + 1, 0, 31);
+      memset((unsigned char*) empty.data + 1, 0, AHV_HASH_LEN);
       initialized = true;
     }
     return empty;
   }
 
   // Record layout:
-  //   * byte 0: T if index is used, F if index is free.
-  //   * bytes 1-32: bcrypt binary hash.
+  //   * byte 0: 0x01 if index is used, 0x00 if index is free.
+  //   * bytes 1-23: bcrypt raw hash.
+  unsigned char data[24];
+};
+
+struct LegacyDiskRecord {
+  static const LegacyDiskRecord& empty_record() {
+    static bool initialized = false;
+    static LegacyDiskRecord empty;
+    if (!initialized) {
+      memset((unsigned char*) empty.data, 0, 32);
+      initialized = true;
+    }
+    return empty;
+  }
+
+  // Record layout:
+  //   * byte 0: 0x01 if index is used, 0x00 if index is free.
+  //   * bytes 1-31: bcrypt base64 hash.
   unsigned char data[32];
 };
 
-#endif  // AHV_DEFENDER_DISK_RECORD_H_
\ No newline at end of file
+static_assert(sizeof(DiskHeader) == 24, "DiskHeader must be 24 bytes.");
+static_assert(sizeof(DiskRecord) == 24, "DiskRecord must be 24 bytes.");
+
+#endif  // AHV_DEFENDER_DISK_RECORD_H_
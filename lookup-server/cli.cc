@@ -10,6 +10,67 @@ using namespace std::chrono;
 
 void PrintUsage() {
   std::cerr << "Usage: ./cli db_server_address add|remove|lookup [quiet|time]" << std::endl;
+  std::cerr << "       ./cli db_server_address stats" << std::endl;
+}
+
+double Ratio(int64_t a, int64_t b) {
+  return b == 0 ? 0.0 : (double) a / b;
+}
+
+// Prints the sum over the shards and how unevenly the shards are loaded.
+void PrintStats(const ahvdefender::AHVStatsResponse& stats) {
+  const ahvdefender::AHVCacheShardStats& total = stats.total();
+  int shards = stats.shards_size();
+  if (shards == 0) {
+    std::cout << "The cache keeps no statistics." << std::endl;
+    return;
+  }
+  std::cout << "Shards: " << shards << std::endl;
+  std::cout << "Lookups: " << total.finds() << ", " << Ratio(total.candidates(), total.finds())
+            << " candidates and " << Ratio(total.rejected(), total.finds())
+            << " false positives per lookup." << std::endl;
+  std::cout << "False positive rate: " << Ratio(total.rejected(), total.candidates())
+            << " of the candidates." << std::endl;
+  std::cout << "Candidates per lookup:";
+  for (int i = 0; i < total.candidate_histogram_size(); ++i) {
+    std::cout << " " << i << (i + 1 == total.candidate_histogram_size() ? "+" : "") << ": "
+              << total.candidate_histogram(i);
+  }
+  std::cout << std::endl;
+  std::cout << "Serving entries: " << total.serving_size() << ", delta adds: " << total.delta_add_size()
+            << ", delta removals: " << total.delta_remove_size() << "." << std::endl;
+  std::cout << "Memory: " << Ratio(total.bytes(), 1 << 20) << "MB." << std::endl;
+  std::cout << "Rebuilds: " << total.rebuilds() << ", " << Ratio(total.rebuild_ms(), total.rebuilds())
+            << "ms on average." << std::endl;
+  std::cout << "Rebuild durations:";
+  for (int i = 0; i < total.rebuild_histogram_size(); ++i) {
+    if (total.rebuild_histogram(i) == 0) continue;
+    std::cout << " <" << (i + 1 == total.rebuild_histogram_size() ? "inf" : std::to_string(1 << i) + "ms")
+              << ": " << total.rebuild_histogram(i);
+  }
+  std::cout << std::endl;
+
+  // Skew: the largest shard against the average one.
+  auto print_skew = [&] (const std::string& name, int64_t (ahvdefender::AHVCacheShardStats::*field)() const,
+                         int64_t sum) -> void {
+    int64_t largest = 0;
+    int largest_shard = 0;
+    for (int b = 0; b < shards; ++b) {
+      int64_t value = (stats.shards(b).*field)();
+      if (value > largest) {
+        largest = value;
+        largest_shard = b;
+      }
+    }
+    std::cout << name << ": " << Ratio(sum, shards) << " per shard on average, at most " << largest
+              << " (shard " << largest_shard << ")." << std::endl;
+  };
+  print_skew("Shard lookups", &ahvdefender::AHVCacheShardStats::finds, total.finds());
+  print_skew("Shard false positives", &ahvdefender::AHVCacheShardStats::rejected, total.rejected());
+  print_skew("Shard serving entries", &ahvdefender::AHVCacheShardStats::serving_size, total.serving_size());
+  print_skew("Shard delta adds", &ahvdefender::AHVCacheShardStats::delta_add_size, total.delta_add_size());
+  print_skew("Shard delta removals", &ahvdefender::AHVCacheShardStats::delta_remove_size, total.delta_remove_size());
+  print_skew("Shard rebuild ms", &ahvdefender::AHVCacheShardStats::rebuild_ms, total.rebuild_ms());
 }
 
 int main(int argc, char** argv) {
@@ -39,6 +100,12 @@ int main(int argc, char** argv) {
   // Init db client.
   auto ahv_database_client = AHVDatabaseClient::New(target);
 
+  // Stats read no AHVs.
+  if (action == "stats") {
+    PrintStats(ahv_database_client->Stats());
+    return 0;
+  }
+
   // One lambda per action.
   auto add_fn = [&] (const std::string& ahv) -> void {
     bool result = ahv_database_client->Add(ahv);
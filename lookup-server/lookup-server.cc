@@ -3,18 +3,34 @@
 #include <iostream>
 #include <signal.h>
 #include <memory>
+#include <cstring>
+#include <string>
 
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 
+#include "AHVCache_Base.hpp"
+#include "AHVCache_Cuckoo.hpp"
+#include "AHVCache_HashMap.hpp"
+#include "AHVCache_Radix.hpp"
+#include "AHVCache_RadixOptions.hpp"
+#include "AHVDatabaseCoreService.hpp"
 #include "AHVDatabaseServiceImpl.hpp"
 #include "AHVDiskDatabase.hpp"
+#include "AHVMmapArray.hpp"
+#include "AHVSearchIndex.hpp"
 
 using grpc::Server;
 using grpc::ServerBuilder;
 
 std::mutex shutdown_mutex;
+std::string cache_type = "radix";
+AHVCache_RadixOptions radix_options;
+AHVVerification verification = AHVVerification::DISK;
+AHVStoreType store_type = AHVStoreType::FILE;
+bool write_snapshot = false;
+bool per_core = false;
 
 void SigIntHandler(int s){
   std::cout << "Caught SIGINT." << std::endl;
@@ -29,28 +45,112 @@ void SetUpSigIntHandler() {
   sigaction(SIGINT, &sig_int_handler, nullptr);
 }
 
+std::unique_ptr<AHVCache_Base> NewCache(const std::string& type) {
+  if (type == "radix") return std::make_unique<AHVCache_Radix<>>(radix_options);
+  if (type == "radix-wide") return std::make_unique<AHVCache_RadixWide>(radix_options);
+  if (type == "hashmap") return std::make_unique<AHVCache_HashMap>();
+  if (type == "cuckoo") return std::make_unique<AHVCache_Cuckoo>();
+  return nullptr;
+}
+
 void RunServer() {
   std::unique_ptr<AHVDiskDatabase> ahv_disk_database =
-      std::make_unique<AHVDiskDatabase>("hashes");
+      std::make_unique<AHVDiskDatabase>("hashes", NewCache(cache_type), verification, store_type);
   ahv_disk_database->Init();
+  AHVDiskDatabase* database = ahv_disk_database.get();
   std::string server_address("0.0.0.0:12000");
-  AHVDatabaseServiceImpl service(std::move(ahv_disk_database));
   grpc::EnableDefaultHealthCheckService(true);
   grpc::reflection::InitProtoReflectionServerBuilderPlugin();
   ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-  builder.RegisterService(&service);
+  // Either the gRPC thread pool serves requests, or a thread per core does.
+  std::unique_ptr<AHVDatabaseServiceImpl> service;
+  std::unique_ptr<AHVDatabaseCoreService> core_service;
+  if (per_core) {
+    core_service = std::make_unique<AHVDatabaseCoreService>(database);
+    core_service->Register(&builder);
+  } else {
+    service = std::make_unique<AHVDatabaseServiceImpl>(std::move(ahv_disk_database));
+    builder.RegisterService(service.get());
+  }
   std::unique_ptr<Server> server(builder.BuildAndStart());
   std::cout << "Server listening on " << server_address << std::endl;
+  if (core_service != nullptr) {
+    core_service->Start();
+  }
   std::thread t([&] () -> void { server->Wait(); });
   shutdown_mutex.lock();
   shutdown_mutex.lock();
   server->Shutdown();
   t.join();
+  if (core_service != nullptr) {
+    core_service->Stop();
+  }
+  if (write_snapshot && !database->WriteSnapshot()) {
+    std::cerr << "Could not write the cache snapshot." << std::endl;
+  }
+}
+
+void PrintUsage() {
+  std::cout << "Usage: ./lookup-server [--cache=radix|radix-wide|hashmap|cuckoo] "
+            << "[--huge-pages=none|transparent|explicit] "
+            << "[--search=binary|eytzinger|interpolation] "
+            << "[--serving=plain|compressed] [--bloom-filter] "
+            << "[--verify=disk|memory] [--store=file|mmap] [--snapshot] "
+            << "[--threading=pool|per-core]" << std::endl;
+}
+
+bool ParseFlags(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--cache=", 8) == 0) {
+      cache_type = argv[i] + 8;
+      if (cache_type != "radix" && cache_type != "radix-wide" &&
+          cache_type != "hashmap" && cache_type != "cuckoo") return false;
+    } else if (strcmp(argv[i], "--huge-pages=none") == 0) {
+      AHVDefaultHugePages() = AHVHugePages::NONE;
+    } else if (strcmp(argv[i], "--huge-pages=transparent") == 0) {
+      AHVDefaultHugePages() = AHVHugePages::TRANSPARENT;
+    } else if (strcmp(argv[i], "--huge-pages=explicit") == 0) {
+      AHVDefaultHugePages() = AHVHugePages::EXPLICIT;
+    } else if (strcmp(argv[i], "--search=binary") == 0) {
+      AHVDefaultSearch() = AHVSearch::BINARY;
+    } else if (strcmp(argv[i], "--search=eytzinger") == 0) {
+      AHVDefaultSearch() = AHVSearch::EYTZINGER;
+    } else if (strcmp(argv[i], "--search=interpolation") == 0) {
+      AHVDefaultSearch() = AHVSearch::INTERPOLATION;
+    } else if (strcmp(argv[i], "--serving=plain") == 0) {
+      radix_options.compressed_serving = false;
+    } else if (strcmp(argv[i], "--serving=compressed") == 0) {
+      radix_options.compressed_serving = true;
+    } else if (strcmp(argv[i], "--bloom-filter") == 0) {
+      radix_options.bloom_filter = true;
+    } else if (strcmp(argv[i], "--verify=disk") == 0) {
+      verification = AHVVerification::DISK;
+    } else if (strcmp(argv[i], "--verify=memory") == 0) {
+      verification = AHVVerification::MEMORY;
+    } else if (strcmp(argv[i], "--store=file") == 0) {
+      store_type = AHVStoreType::FILE;
+    } else if (strcmp(argv[i], "--store=mmap") == 0) {
+      store_type = AHVStoreType::MMAP;
+    } else if (strcmp(argv[i], "--snapshot") == 0) {
+      write_snapshot = true;
+    } else if (strcmp(argv[i], "--threading=pool") == 0) {
+      per_core = false;
+    } else if (strcmp(argv[i], "--threading=per-core") == 0) {
+      per_core = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
 }
 
 int main(int argc, char** argv) {
   std::ios::sync_with_stdio(false);
+  if (!ParseFlags(argc, argv)) {
+    PrintUsage();
+    exit(1);
+  }
   SetUpSigIntHandler();
   RunServer();
   std::cout << "Bye." << std::endl;
@@ -0,0 +1,133 @@
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "AHVCache_Base.hpp"
+#include "AHVCache_Cuckoo.hpp"
+#include "AHVCache_HashMap.hpp"
+#include "AHVCache_Radix.hpp"
+#include "AHVCache_RadixOptions.hpp"
+#include "AHVCandidates.hpp"
+#include "AHVHash.hpp"
+
+using namespace std::chrono;
+
+void PrintUsage() {
+  std::cout << "Usage: ./cache-bench radix|radix-wide|radix-compressed|radix-bloom|hashmap|cuckoo count lookups [batch_size]" << std::endl;
+}
+
+std::unique_ptr<AHVCache_Base> NewCache(const std::string& type) {
+  if (type == "radix") return std::make_unique<AHVCache_Radix<>>();
+  if (type == "radix-wide") return std::make_unique<AHVCache_RadixWide>();
+  if (type == "radix-compressed") {
+    AHVCache_RadixOptions options;
+    options.compressed_serving = true;
+    return std::make_unique<AHVCache_Radix<>>(options);
+  }
+  if (type == "radix-bloom") {
+    AHVCache_RadixOptions options;
+    options.bloom_filter = true;
+    return std::make_unique<AHVCache_Radix<>>(options);
+  }
+  if (type == "hashmap") return std::make_unique<AHVCache_HashMap>();
+  if (type == "cuckoo") return std::make_unique<AHVCache_Cuckoo>();
+  return nullptr;
+}
+
+AHVHash RandomHash(std::mt19937_64& mt) {
+  AHVHash hash;
+  for (int i = 0; i < AHV_HASH_LEN; i += 8) {
+    uint64_t r = mt();
+    memcpy(hash.data + i, &r, std::min(8, AHV_HASH_LEN - i));
+  }
+  return hash;
+}
+
+int main(int argc, char** argv) {
+  // Check argument count.
+  if (argc != 4 && argc != 5) {
+    PrintUsage();
+    exit(1);
+  }
+
+  std::unique_ptr<AHVCache_Base> cache = NewCache(argv[1]);
+  if (cache == nullptr) {
+    PrintUsage();
+    exit(1);
+  }
+  int64_t count = atoll(argv[2]);
+  int64_t lookups = atoll(argv[3]);
+  int batch_size = argc == 5 ? atoi(argv[4]) : 0;
+
+  // Bulk load random hashes on all cores, the record index is the position
+  // of the hash.
+  std::mt19937_64 mt(42);
+  std::vector<AHVHash> hashes(count);
+  for (int64_t i = 0; i < count; ++i) {
+    hashes[i] = RandomHash(mt);
+  }
+  auto start = high_resolution_clock::now();
+  cache->Reserve(count);
+  int parts = std::max(1, (int) std::thread::hardware_concurrency());
+  int64_t part_size = (count + parts - 1) / parts;
+  cache->StartLoad(parts);
+  std::vector<std::thread> threads;
+  for (int part = 0; part < parts; ++part) {
+    threads.emplace_back([&, part] () -> void {
+      for (int64_t i = part * part_size; i < std::min(count, (part + 1) * part_size); ++i) {
+        cache->LoadPart(part, hashes[i], i);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  cache->FinishLoad();
+  auto stop = high_resolution_clock::now();
+  std::cout << "Loaded " << count << " hashes in "
+            << duration_cast<milliseconds>(stop - start).count() << "ms." << std::endl;
+
+  // Half of the lookups hit known hashes, half miss.
+  std::vector<AHVHash> queries(lookups);
+  for (int64_t i = 0; i < lookups; ++i) {
+    queries[i] = (i % 2 == 0 && count > 0) ? hashes[mt() % count] : RandomHash(mt);
+  }
+
+  AHVCandidates candidates;
+  int64_t total_candidates = 0;
+  start = high_resolution_clock::now();
+  for (int64_t i = 0; i < lookups; ++i) {
+    cache->Find(queries[i], &candidates);
+    total_candidates += candidates.size();
+  }
+  stop = high_resolution_clock::now();
+  auto duration_ns = duration_cast<nanoseconds>(stop - start).count();
+  std::cout << "Find: " << (lookups > 0 ? duration_ns / lookups : 0) << "ns / lookup, "
+            << total_candidates << " candidates." << std::endl;
+
+  if (batch_size > 0) {
+    std::vector<AHVCandidates> batch_candidates(batch_size);
+    total_candidates = 0;
+    start = high_resolution_clock::now();
+    for (int64_t first = 0; first < lookups; first += batch_size) {
+      int count = (int) std::min((int64_t) batch_size, lookups - first);
+      cache->FindBatch(&queries[first], count, batch_candidates.data());
+      for (int i = 0; i < count; ++i) {
+        total_candidates += batch_candidates[i].size();
+      }
+    }
+    stop = high_resolution_clock::now();
+    duration_ns = duration_cast<nanoseconds>(stop - start).count();
+    std::cout << "FindBatch: " << (lookups > 0 ? duration_ns / lookups : 0) << "ns / lookup, "
+              << total_candidates << " candidates." << std::endl;
+  }
+
+  return 0;
+}
@@ -8,6 +8,7 @@
 #include <mutex>
 
 #include "BCryptHasher.hpp"
+#include "DiskRecord.hpp"
 
 void PrintUsage() {
   std::cout << "Usage: ./db-build < plaintext_file > hashes_file" << std::endl;
@@ -15,9 +16,11 @@ void PrintUsage() {
 
 void HashAndWrite(const std::string& ahv, const BCryptHasher& hasher) {
   static std::mutex m;
-  std::string h = hasher.ComputeHash(ahv);
+  DiskRecord record;
+  record.set_used(true);
+  record.set_hash(hasher.ComputeHash(ahv));
   m.lock();
-  printf("%c%s", (char) 0x01, h.substr(h.size() - 31).c_str());
+  fwrite(record.data, 1, sizeof(record.data), stdout);
   m.unlock();
 }
 
@@ -28,6 +31,8 @@ int main(int argc, char** argv) {
     exit(1);
   }
 
+  fwrite(&DiskHeader::current(), 1, sizeof(DiskHeader), stdout);
+
   BCryptHasher hasher;
   int nthreads = std::thread::hardware_concurrency();
   std::vector<std::thread> t(nthreads);
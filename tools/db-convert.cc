@@ -0,0 +1,65 @@
+#include <string>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#include "AHVHash.hpp"
+#include "DiskRecord.hpp"
+
+void PrintUsage() {
+  std::cout << "Usage: ./db-convert legacy_hashes_file compact_hashes_file" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  // Check argument count.
+  if (argc != 3) {
+    PrintUsage();
+    exit(1);
+  }
+
+  FILE* legacy_f = fopen(argv[1], "rb");
+  if (legacy_f == nullptr) {
+    std::cerr << "Cannot open " << argv[1] << "." << std::endl;
+    exit(1);
+  }
+
+  // Refuse to convert a file that is already compact.
+  unsigned char magic[8];
+  if (fread(magic, 1, 8, legacy_f) == 8 && DiskHeader::HasMagic(magic)) {
+    std::cerr << argv[1] << " is already in the compact format." << std::endl;
+    exit(1);
+  }
+  fseek(legacy_f, 0, SEEK_SET);
+
+  FILE* compact_f = fopen(argv[2], "wb");
+  if (compact_f == nullptr) {
+    std::cerr << "Cannot open " << argv[2] << "." << std::endl;
+    exit(1);
+  }
+  fwrite(&DiskHeader::current(), 1, sizeof(DiskHeader), compact_f);
+
+  // Free records are kept, so record indexes stay the same.
+  LegacyDiskRecord legacy[128];
+  DiskRecord compact[128];
+  int64_t total_hashes = 0, total_free = 0;
+  size_t count;
+  while ((count = fread(legacy, sizeof(LegacyDiskRecord), 128, legacy_f)) > 0) {
+    for (size_t i = 0; i < count; ++i) {
+      if (legacy[i].data[0] == 0x01) {
+        compact[i].set_used(true);
+        compact[i].set_hash(AHVHash::FromBase64((const char*) legacy[i].data + 1));
+        ++total_hashes;
+      } else {
+        compact[i] = DiskRecord::empty_record();
+        ++total_free;
+      }
+    }
+    fwrite(compact, sizeof(DiskRecord), count, compact_f);
+  }
+
+  fclose(legacy_f);
+  fclose(compact_f);
+  printf("Converted %ld hashes, %ld free records.\n", (long) total_hashes, (long) total_free);
+  return 0;
+}
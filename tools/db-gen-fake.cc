@@ -5,6 +5,8 @@
 #include <cstring>
 #include <cstdio>
 
+#include "DiskRecord.hpp"
+
 void PrintUsage() {
   std::cout << "Usage: ./db-gen-fake count hashes_file" << std::endl;
 }
@@ -18,7 +20,8 @@ int main(int argc, char** argv) {
   }
 
   int n = atoi(argv[1]);
-  FILE* hashes_f = fopen(argv[2], "w");
+  FILE* hashes_f = fopen(argv[2], "wb");
+  fwrite(&DiskHeader::current(), 1, sizeof(DiskHeader), hashes_f);
 
   std::random_device rd;
   std::mt19937 mt(rd());
@@ -30,7 +33,7 @@ int main(int argc, char** argv) {
       data[i] = dist(mt);
     }
     *(unsigned char*)data = 0x01;
-    fwrite((void*)data, 1, 32, hashes_f);
+    fwrite((void*)data, 1, sizeof(DiskRecord), hashes_f);
   }
   delete[] data;
 
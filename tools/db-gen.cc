@@ -8,6 +8,7 @@
 #include <cstdio>
 
 #include "BCryptHasher.hpp"
+#include "DiskRecord.hpp"
 
 void PrintUsage() {
   std::cout << "Usage: ./db-gen count plaintext_file hashes_file" << std::endl;
@@ -18,10 +19,12 @@ FILE* hashes_f;
 
 void HashAndWrite(const std::string& ahv, const BCryptHasher& hasher) {
   static std::mutex m;
-  std::string h = hasher.ComputeHash(ahv);
+  DiskRecord record;
+  record.set_used(true);
+  record.set_hash(hasher.ComputeHash(ahv));
   m.lock();
   fprintf(plaintext_f, "%s\n", ahv.c_str());
-  fprintf(hashes_f, "%c%s", (char) 0x01, h.substr(h.size() - 31).c_str());
+  fwrite(record.data, 1, sizeof(record.data), hashes_f);
   m.unlock();
 }
 
@@ -33,7 +36,8 @@ int main(int argc, char** argv) {
   }
 
   plaintext_f = fopen(argv[2], "wb");
-  hashes_f = fopen(argv[3], "w");
+  hashes_f = fopen(argv[3], "wb");
+  fwrite(&DiskHeader::current(), 1, sizeof(DiskHeader), hashes_f);
 
   int nthreads = std::thread::hardware_concurrency();
 
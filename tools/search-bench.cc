@@ -0,0 +1,72 @@
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#include "AHVMmapArray.hpp"
+#include "AHVSearchIndex.hpp"
+
+using namespace std::chrono;
+
+void PrintUsage() {
+  std::cout << "Usage: ./search-bench max_count lookups" << std::endl;
+}
+
+// Times lookups of random keys in a sorted array of count random keys, like
+// the serving area of a radix shard.
+void Bench(int64_t count, int64_t lookups) {
+  std::mt19937_64 mt(42);
+  AHVMmapArray<uint64_t> keys(count);
+  for (int64_t i = 0; i < count; ++i) {
+    keys[i] = mt();
+  }
+  std::sort(keys.get(), keys.get() + count);
+  std::vector<uint64_t> queries(lookups);
+  for (int64_t i = 0; i < lookups; ++i) {
+    queries[i] = mt();
+  }
+
+  std::cout << count << " keys:";
+  const char* names[] = {"binary", "eytzinger", "interpolation"};
+  AHVSearch searches[] = {AHVSearch::BINARY, AHVSearch::EYTZINGER, AHVSearch::INTERPOLATION};
+  for (int s = 0; s < 3; ++s) {
+    AHVSearchIndex index(searches[s]);
+    index.Build(keys.get(), count);
+    // Sum the positions so the searches are not optimized away.
+    uint64_t checksum = 0;
+    auto start = high_resolution_clock::now();
+    for (int64_t i = 0; i < lookups; ++i) {
+      checksum += index.LowerBound(keys.get(), count, queries[i]);
+    }
+    auto stop = high_resolution_clock::now();
+    auto duration_ns = duration_cast<nanoseconds>(stop - start).count();
+    std::cout << " " << names[s] << " " << duration_ns / lookups << "ns"
+              << " (" << checksum % 1000 << ")";
+  }
+  std::cout << std::endl;
+}
+
+int main(int argc, char** argv) {
+  // Check argument count.
+  if (argc != 3) {
+    PrintUsage();
+    exit(1);
+  }
+
+  int64_t max_count = atoll(argv[1]);
+  int64_t lookups = atoll(argv[2]);
+  if (lookups <= 0) {
+    PrintUsage();
+    exit(1);
+  }
+
+  // Powers of 4 from 1M up to max_count.
+  for (int64_t count = 1 << 20; count <= max_count; count *= 4) {
+    Bench(count, lookups);
+  }
+
+  return 0;
+}